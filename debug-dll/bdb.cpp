@@ -1,4 +1,6 @@
 #include "bdb.h"
+#include "bdb_trace.h"
+#include <algorithm>
 #include <print>
 #include <filesystem>
 #include <string_view>
@@ -8,9 +10,7 @@ namespace {
     PyObject* quit_error = nullptr;
 
     // like PyCapsule (which doesn't exist in python 2.3.4)
-    struct bf2PyDebugger : PyObject {
-        bdb* debugger;
-    };
+    using bf2PyDebugger = bdb::trace_object;
 
     PyTypeObject bf2PyDebuggerType = {
         .ob_refcnt = 1,
@@ -18,6 +18,78 @@ namespace {
         .tp_basicsize = sizeof(bf2PyDebugger),
         .tp_flags = Py_TPFLAGS_DEFAULT
     };
+
+    // '*' matches any sequence (including '/'), '?' any single character
+    bool glob_match(std::string_view pattern, std::string_view text)
+    {
+        std::size_t p = 0, t = 0, star = std::string_view::npos, mark = 0;
+        while (t < text.size()) {
+            if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == text[t])) {
+                p++;
+                t++;
+            }
+            else if (p < pattern.size() && pattern[p] == '*') {
+                star = p++;
+                mark = t;
+            }
+            else if (star != std::string_view::npos) {
+                p = star + 1;
+                t = ++mark;
+            }
+            else {
+                return false;
+            }
+        }
+
+        while (p < pattern.size() && pattern[p] == '*') {
+            p++;
+        }
+
+        return p == pattern.size();
+    }
+
+    std::string normalize_glob(std::string path)
+    {
+        std::ranges::replace(path, '\\', '/');
+        std::ranges::transform(path, path.begin(), [](auto c) { return static_cast<char>(std::tolower(c)); });
+        return path;
+    }
+
+    // the fast locals of a function frame are only copied into f_locals on demand,
+    // so the dict must be refreshed before every evaluation (like frame.f_locals in python's bdb)
+    PyObject* eval_locals(PyFrameObject* frame)
+    {
+        if (!frame->f_locals || (frame->f_code->co_flags & CO_OPTIMIZED)) {
+            PyFrame_FastToLocals(frame);
+        }
+
+        return frame->f_locals ? frame->f_locals : frame->f_globals;
+    }
+
+    // the callable which is injected into patched code objects (breakpoint_engine::CODE_PATCH)
+    struct bf2PyBreakpointHook : PyObject {
+        bdb* debugger;
+    };
+
+    PyTypeObject bf2PyBreakpointHookType = {
+        .ob_refcnt = 1,
+        .tp_name = (char*)"bf2py.BreakpointHook",
+        .tp_basicsize = sizeof(bf2PyBreakpointHook),
+        .tp_flags = Py_TPFLAGS_DEFAULT
+    };
+
+    // replaces __builtin__.__import__ (breakpoint_engine::CODE_PATCH), so functions of modules imported after the breakpoints were set get patched
+    struct bf2PyImportHook : PyObject {
+        bdb* debugger; // nullptr once the debugger is gone, the hook then only forwards
+        PyObject* import; // the original __import__
+    };
+
+    PyTypeObject bf2PyImportHookType = {
+        .ob_refcnt = 1,
+        .tp_name = (char*)"bf2py.ImportHook",
+        .tp_basicsize = sizeof(bf2PyImportHook),
+        .tp_flags = Py_TPFLAGS_DEFAULT
+    };
 }
 
 void bdb::raiseException(const std::string& message)
@@ -26,13 +98,32 @@ void bdb::raiseException(const std::string& message)
 }
 
 bdb::bdb()
+    : _trace_functions(&trace_functions<bdb>())
 {
-
 }
 
 bdb::~bdb()
 {
     disable_trace();
+    _patcher.restore();
+
+    if (_pyBreakpointHook && Py_IsInitialized()) {
+        Py_DECREF(_pyBreakpointHook);
+    }
+
+    if (_pyImportHook && Py_IsInitialized()) {
+        // someone else might have wrapped our hook in the meantime, so it stays and only forwards
+        auto hook = static_cast<bf2PyImportHook*>(_pyImportHook);
+        PyNewRef builtins = PyImport_ImportModule((char*)"__builtin__");
+        PyNewRef current = builtins ? PyObject_GetAttrString(builtins, (char*)"__import__") : nullptr;
+        if (current && static_cast<PyObject*>(current) == _pyImportHook) {
+            PyObject_SetAttrString(builtins, (char*)"__import__", hook->import);
+        }
+
+        PyErr_Clear();
+        hook->debugger = nullptr;
+        Py_DECREF(_pyImportHook);
+    }
 }
 
 bool bdb::pyInit()
@@ -49,14 +140,18 @@ bool bdb::pyInit()
     static bool typeInitialized = false;
     if (!typeInitialized) {
         bf2PyDebuggerType.tp_call = [](PyObject* self, PyObject* args, PyObject* kwds) -> PyObject* {
+            if (!static_cast<bf2PyDebugger*>(self)->debugger->needs_trace()) {
+                // also removes the trace_trampoline
+                PyEval_SetTrace(nullptr, nullptr);
+                Py_RETURN_NONE;
+            }
+
             // the very first trace call is initiated via /Python/sysmodule.c/trace_trampoline
             // which has slightly more overhead than our own trace_dispatch and which works slightly different
-            PyEval_SetTrace(
-                [](PyObject* obj, PyFrameObject* frame, int event, PyObject* arg) -> int {
-                    return static_cast<bf2PyDebugger*>(obj)->debugger->trace_dispatch(frame, event, arg);
-                },
-                self
-			);
+            // Note: this is a new thread, its id might have been used by a thread which already ended
+            auto debugger = static_cast<bf2PyDebugger*>(self)->debugger;
+            debugger->reset(debugger->thread(PyThreadState_GET()->thread_id));
+            debugger->enable_trace();
 
             // after the first call, python's trace will no longer ues the trace_trampoline, but instead our own function
             Py_RETURN_NONE;
@@ -69,16 +164,62 @@ bool bdb::pyInit()
         std::println(stderr, "Failed to initialize bf2py debugger type");
     }
 
-    return !!quit_error && typeInitialized;
+    static bool hookTypeInitialized = false;
+    if (!hookTypeInitialized) {
+        bf2PyBreakpointHookType.tp_call = [](PyObject* self, PyObject* args, PyObject* kwds) -> PyObject* {
+            auto line = PyInt_AsLong(PyTuple_GET_ITEM(args, 0));
+            auto frame = PyEval_GetFrame();
+            if (frame && static_cast<bf2PyBreakpointHook*>(self)->debugger->dispatch_breakpoint(frame, line) != 0) {
+                return nullptr;
+            }
+
+            Py_RETURN_NONE;
+        };
+
+        hookTypeInitialized = PyType_Ready(&bf2PyBreakpointHookType) == 0;
+    }
+
+    if (!hookTypeInitialized) {
+        std::println(stderr, "Failed to initialize bf2py breakpoint hook type");
+    }
+
+    static bool importHookTypeInitialized = false;
+    if (!importHookTypeInitialized) {
+        bf2PyImportHookType.tp_call = [](PyObject* self, PyObject* args, PyObject* kwds) -> PyObject* {
+            auto hook = static_cast<bf2PyImportHook*>(self);
+            auto debugger = hook->debugger;
+            if (!debugger) {
+                return PyObject_Call(hook->import, args, kwds);
+            }
+
+            // nested imports are done once the outermost one returns
+            debugger->_import_depth++;
+            auto module = PyObject_Call(hook->import, args, kwds);
+            if (--debugger->_import_depth == 0 && module) {
+                debugger->imported();
+            }
+
+            return module;
+        };
+
+        importHookTypeInitialized = PyType_Ready(&bf2PyImportHookType) == 0;
+    }
+
+    if (!importHookTypeInitialized) {
+        std::println(stderr, "Failed to initialize bf2py import hook type");
+    }
+
+    return !!quit_error && typeInitialized && hookTypeInitialized && importHookTypeInitialized;
 }
 
-bool bdb::enable_trace()
+PyObject* bdb::py_debugger(thread_state* ts)
 {
-    if (!_pyDebugger) {
+    auto& obj = ts ? ts->trace_obj : _pyDebugger;
+    if (!obj) {
         auto* self = PyObject_NEW(bf2PyDebugger, &bf2PyDebuggerType);
         if (!self) {
             std::println(stderr, "Failed to create bf2PyDebugger instance");
-			return false;
+			return nullptr;
 		}
 
         new (self) bf2PyDebugger();
@@ -86,17 +227,42 @@ bool bdb::enable_trace()
         self->ob_type = &bf2PyDebuggerType;
         self->ob_type->ob_refcnt++;
         self->debugger = this;
+        self->state = ts;
 
-        _pyDebugger = self;
+        obj = self;
 	}
 
-	PyEval_SetTrace(
-        [](PyObject* obj, PyFrameObject* frame, int event, PyObject* arg) -> int {
-            return reinterpret_cast<bf2PyDebugger*>(obj)->debugger->trace_dispatch(frame, event, arg);
-        },
-        reinterpret_cast<PyObject*>(_pyDebugger)
-    );
+    return obj;
+}
+
+bdb::thread_state& bdb::thread(long threadId)
+{
+    auto& ts = _thread_states[threadId];
+    if (!ts) {
+        ts = std::make_unique<thread_state>();
+        ts->thread_id = threadId;
+        if (_recorder_capacity) {
+            ts->recorder.resize(_recorder_capacity);
+        }
+    }
+
+    return *ts;
+}
+
+bdb::thread_state* bdb::find_thread(long threadId)
+{
+    auto it = _thread_states.find(threadId);
+    return it != _thread_states.end() ? it->second.get() : nullptr;
+}
+
+bool bdb::enable_trace()
+{
+    auto& ts = thread(PyThreadState_GET()->thread_id);
+    if (!py_debugger() || !py_debugger(&ts)) {
+        return false;
+    }
 
+	PyEval_SetTrace(trace_function_for(select_trace(ts)), ts.trace_obj);
     return true;
 }
 
@@ -122,7 +288,12 @@ bool bdb::enable_thread_trace()
 
 	// register the callback which is implemented in bf2PyDebuggerType.tp_call
     // (the debugger object itself is callable)
-    PyNewRef res = PyObject_CallFunction(setTrace, (char*)"O", _pyDebugger);
+    auto pyDebugger = py_debugger();
+    if (!pyDebugger) {
+        return false;
+    }
+
+    PyNewRef res = PyObject_CallFunction(setTrace, (char*)"O", pyDebugger);
     if (!res) {
         std::println(stderr, "Failed to call threading.settrace");
     }
@@ -133,9 +304,6 @@ bool bdb::enable_thread_trace()
 void bdb::disable_trace()
 {
     if (_pyDebugger) {
-		Py_DECREF(_pyDebugger);
-        _pyDebugger = nullptr;
-
         // the debugger might be destructed after Py_Finalize was called,
         // in this case we must not call any more Py* functions
         if (Py_IsInitialized()) {
@@ -149,10 +317,270 @@ void bdb::disable_trace()
                     }
                 }
             }
+
+            Py_DECREF(_pyDebugger);
+            for (auto& [threadId, ts] : _thread_states) {
+                Py_XDECREF(ts->trace_obj);
+            }
+        }
+
+        _pyDebugger = nullptr;
+        _thread_states.clear();
+    }
+}
+
+bool bdb::needs_trace() const
+{
+    return _coverage_enabled || _recorder_capacity || needs_debug_trace();
+}
+
+bool bdb::needs_debug_trace() const
+{
+    // user_entry needs to see the first call
+    if (_entry_pending || _force_trace) {
+        return true;
+    }
+
+    if (_postmortem && !_attached) {
+        return true;
+    }
+
+    if (!_attached) {
+        return false;
+    }
+
+    if (_exmode != exception_mode::NEVER) {
+        return true;
+    }
+
+    for (const auto& [threadId, ts] : _thread_states) {
+        if (ts->step || ts->stopframe || ts->returnframe) {
+            return true;
+        }
+    }
+
+    if (!_data_breaks.empty() || !_function_breaks.empty()) {
+        return true;
+    }
+
+    // the CODE_PATCH engine handles breakpoints without trace events
+    return _engine == breakpoint_engine::TRACE && !_breaks.empty();
+}
+
+bdb::trace_kind bdb::select_trace(const thread_state& ts) const
+{
+    if (!needs_debug_trace()) {
+        if (_coverage_enabled) {
+            return trace_kind::COVERAGE;
+        }
+
+        if (_recorder_capacity) {
+            return trace_kind::RECORDING;
+        }
+    }
+
+    if (ts.step) {
+        return trace_kind::STEPPING;
+    }
+
+    if (ts.stopframe || ts.returnframe) {
+        return trace_kind::STEP_OVER;
+    }
+
+    return trace_kind::RUNNING;
+}
+
+void bdb::update_trace()
+{
+    const auto trace = needs_trace();
+    for (auto interpreter = PyInterpreterState_Head(); interpreter; interpreter = PyInterpreterState_Next(interpreter)) {
+        for (auto thread = PyInterpreterState_ThreadHead(interpreter); thread; thread = PyThreadState_Next(thread)) {
+            // Note: threads started via threading.settrace use _pyDebugger as c_traceobj (with the trace_trampoline)
+            auto& ts = this->thread(thread->thread_id);
+            const auto traced = thread->c_traceobj && (thread->c_traceobj == ts.trace_obj || thread->c_traceobj == _pyDebugger);
+            if (traced == trace && (!trace || thread->c_tracefunc == trace_function_for(select_trace(ts)))) {
+                continue;
+            }
+
+            auto currThread = PyThreadState_Swap(thread);
+            if (trace) {
+                enable_trace();
+            }
+            else {
+                PyEval_SetTrace(nullptr, nullptr);
+            }
+            PyThreadState_Swap(currThread);
+        }
+    }
+
+    if (!trace) {
+        // no more return events will arrive for the ignored frames (and their addresses will be reused)
+        for (auto& [threadId, ts] : _thread_states) {
+            ts->ignored_frames.clear();
         }
     }
 }
 
+void bdb::enable_coverage(bool enable)
+{
+    _coverage_enabled = enable;
+    update_trace();
+}
+
+void bdb::enable_recorder(std::size_t capacity, const std::filesystem::path& crashPath)
+{
+    _recorder_capacity = capacity;
+    _recorder_path = crashPath;
+    for (auto& [threadId, ts] : _thread_states) {
+        ts->recorder.resize(capacity);
+    }
+
+    update_trace();
+}
+
+std::vector<flight_recorder::entry> bdb::recorded_events(std::size_t n) const
+{
+    std::vector<std::pair<long, const flight_recorder*>> recorders;
+    for (const auto& [threadId, ts] : _thread_states) {
+        if (ts->recorder.enabled()) {
+            recorders.emplace_back(threadId, &ts->recorder);
+        }
+    }
+
+    return flight_recorder::last(recorders, n);
+}
+
+void bdb::write_recorder(thread_state& ts, PyObject* excInfo)
+{
+    // the trace function is called with the exception fetched, so the repr can be taken as usual
+    // (but it might run python code, which must not be traced)
+    ts.evaling = true;
+    PyNewRef typeStr = PyObject_Str(PyTuple_GET_ITEM(excInfo, 0));
+    PyNewRef valueRepr = PyObject_Repr(PyTuple_GET_ITEM(excInfo, 1));
+    ts.evaling = false;
+    PyErr_Clear();
+
+    const auto header = std::format("unhandled exception: {}: {}",
+        typeStr ? PyString_AsString(typeStr) : "?",
+        valueRepr ? PyString_AsString(valueRepr) : "?");
+    if (flight_recorder::write(_recorder_path, header, recorded_events(_recorder_capacity))) {
+        std::println(stderr, "[recorder] {}, wrote the last trace events to {}", header, _recorder_path.string());
+    }
+}
+
+void bdb::set_postmortem(bool enable)
+{
+    _postmortem = enable;
+    update_trace();
+}
+
+void bdb::attach()
+{
+    _attached = true;
+    update_trace();
+}
+
+void bdb::detach()
+{
+    _attached = false;
+    _breaks.clear();
+    _exmode = exception_mode::NEVER;
+    _data_breaks.clear();
+    _data_reach.clear();
+    _function_breaks.clear();
+    _code_function_breaks.clear();
+    _code_breaks.clear();
+    patch_breakpoints();
+    for (auto& [threadId, ts] : _thread_states) {
+        set_continue(*ts);
+    }
+    update_trace();
+}
+
+void bdb::patch_breakpoints()
+{
+    if (_engine != breakpoint_engine::CODE_PATCH) {
+        return;
+    }
+
+    if (!_pyBreakpointHook) {
+        auto* hook = PyObject_NEW(bf2PyBreakpointHook, &bf2PyBreakpointHookType);
+        if (!hook) {
+            std::println(stderr, "Failed to create bf2PyBreakpointHook instance");
+            return;
+        }
+
+        hook->debugger = this;
+        _pyBreakpointHook = hook;
+    }
+
+    install_import_hook();
+
+    std::set<std::string> patchedFiles;
+    auto patched = _patcher.apply(_pyBreakpointHook, [&](PyCodeObject* code) -> const line_bitset* {
+        // checking the filename first keeps the index free from all the code objects without breakpoints
+        auto filename = canonic(PyString_AsString(code->co_filename));
+        if (!_breaks.contains(filename)) {
+            return nullptr;
+        }
+
+        auto codeBreaks = code_breaks(code);
+        if (codeBreaks) {
+            patchedFiles.insert(std::move(filename));
+        }
+
+        return codeBreaks ? &codeBreaks->lines : nullptr;
+    });
+
+    // files whose functions don't exist yet are patched again once new modules were imported
+    _unpatched_files.clear();
+    for (const auto& [filename, breaks] : _breaks) {
+        if (!breaks.empty() && !patchedFiles.contains(filename)) {
+            _unpatched_files.insert(filename);
+        }
+    }
+
+    _patched_modules = static_cast<int>(PyDict_Size(PyImport_GetModuleDict()));
+    std::println("[debugger] patched {} functions", patched);
+}
+
+void bdb::install_import_hook()
+{
+    if (_pyImportHook) {
+        return;
+    }
+
+    PyNewRef builtins = PyImport_ImportModule((char*)"__builtin__");
+    auto import = builtins ? PyObject_GetAttrString(builtins, (char*)"__import__") : nullptr;
+    auto hook = import ? PyObject_NEW(bf2PyImportHook, &bf2PyImportHookType) : nullptr;
+    if (!hook) {
+        std::println(stderr, "[debugger] failed to hook __import__, breakpoints in modules imported later aren't patched");
+        Py_XDECREF(import);
+        PyErr_Clear();
+        return;
+    }
+
+    hook->debugger = this;
+    hook->import = import;
+    if (PyObject_SetAttrString(builtins, (char*)"__import__", hook) != 0) {
+        std::println(stderr, "[debugger] failed to hook __import__: {}", py_utils::fetch_error());
+        Py_DECREF(hook);
+        return;
+    }
+
+    _pyImportHook = hook;
+}
+
+void bdb::imported()
+{
+    // gc.get_objects is only walked again if there are breakpoints left to patch and the import brought new modules
+    if (_engine != breakpoint_engine::CODE_PATCH || _unpatched_files.empty() || PyDict_Size(PyImport_GetModuleDict()) == _patched_modules) {
+        return;
+    }
+
+    patch_breakpoints();
+}
+
 std::string bdb::normalize_path(const std::string& filename)
 {
 	if (filename.starts_with("<") && filename.ends_with(">")) {
@@ -164,18 +592,27 @@ std::string bdb::normalize_path(const std::string& filename)
 	return path;
 }
 
-void bdb::reset()
+void bdb::reset(thread_state& ts)
 {
-    _ignored_frames.clear();
-    _step = false;
-    _stopframe = nullptr;
-    _returnframe = nullptr;
+    ts.ignored_frames.clear();
+    ts.step = false;
+    ts.stopframe = nullptr;
+    ts.returnframe = nullptr;
 }
 
-void bdb::pause()
+void bdb::pause(long threadId)
 {
-    _ignored_frames.clear();
-    set_step();
+    // an unknown thread (e.g. the client's default thread) pauses all of them
+    if (auto ts = find_thread(threadId)) {
+        set_step(*ts);
+    }
+    else {
+        for (auto& [id, ts] : _thread_states) {
+            set_step(*ts);
+        }
+    }
+
+    update_trace();
 }
 
 std::string bdb::canonic(const std::string& filename)
@@ -229,144 +666,230 @@ std::pair<std::deque<std::pair<PyFrameObject*, std::size_t>>, std::size_t> bdb::
     return { stack, i };
 }
 
-int bdb::trace_dispatch(PyFrameObject* frame, int event, PyObject* arg)
+int bdb::trace_dispatch(thread_state& ts, PyFrameObject* frame, int event, PyObject* arg)
 {
-    if (trace_ignore()) {
-        // evaluating a breakpoint condition - always happens recuresively
-        return 0;
-    }
+    return dispatch<bdb>(ts, frame, event, arg);
+}
 
-    _currentbp = nullptr;
+int bdb::dispatch_line(thread_state& ts, PyFrameObject* frame)
+{
+    return dispatch_line<bdb>(ts, frame);
+}
 
-    switch (event) {
-    case PyTrace_CALL: return dispatch_call(frame);
-    case PyTrace_EXCEPTION: return dispatch_exception(frame, arg);
-    case PyTrace_LINE: return dispatch_line(frame);
-    case PyTrace_RETURN: return dispatch_return(frame, arg);
-    }
+int bdb::dispatch_call(thread_state& ts, PyFrameObject* frame)
+{
+    return dispatch_call<bdb>(ts, frame);
+}
 
-    return 0;
+int bdb::dispatch_return(thread_state& ts, PyFrameObject* frame, PyObject* arg)
+{
+    return dispatch_return<bdb>(ts, frame, arg);
 }
 
-int bdb::dispatch_line(PyFrameObject* frame)
+int bdb::dispatch_exception(thread_state& ts, PyFrameObject* frame, PyObject* exec)
 {
-    if (_ignored_frames.contains(frame)) {
+    return dispatch_exception<bdb>(ts, frame, exec);
+}
+
+int bdb::dispatch_breakpoint(PyFrameObject* frame, line_t line)
+{
+    // while stepping, the trace function handles this line, the coverage and recording tracers leave breakpoints to the hook
+    callback_scope scope{ *this };
+    auto& ts = thread(frame->f_tstate->thread_id);
+    const auto tstate = frame->f_tstate;
+    if (trace_ignore(ts) || (tstate->c_traceobj && tstate->c_traceobj == ts.trace_obj && checks_breakpoints(tstate->c_tracefunc))) {
         return 0;
     }
 
-    if (stop_here(frame) || break_here(frame)) {
-        user_line(frame);
-
-        if (_quitting) {
-            raiseException("quitting");
-            return -1;
-        }
+    // without a trace function, the interpreter doesn't maintain f_lineno
+    frame->f_lineno = static_cast<int>(line);
+    for (auto f = frame->f_back; f; f = f->f_back) {
+        f->f_lineno = PyCode_Addr2Line(f->f_code, f->f_lasti);
     }
 
-    return 0;
+    ts.currentbp = nullptr;
+    ts.data_hit = nullptr;
+    return dispatch_line(ts, frame);
+}
+
+bool bdb::checks_breakpoints(Py_tracefunc tracefunc) const
+{
+    return tracefunc == trace_function_for(trace_kind::DISPATCH)
+        || tracefunc == trace_function_for(trace_kind::RUNNING)
+        || tracefunc == trace_function_for(trace_kind::STEPPING)
+        || tracefunc == trace_function_for(trace_kind::STEP_OVER);
 }
 
-int bdb::dispatch_call(PyFrameObject* frame)
+bool bdb::stop_here(thread_state& ts, PyFrameObject* frame)
 {
-    if (frame->f_back == nullptr) {
-        user_entry(frame);
+    if (ts.step || frame == ts.stopframe) {
+        // library frames are passed through (and ignored by dispatch_call), step-in lands in the next user frame
+        return !_just_my_code || !is_library(frame->f_code);
     }
-    else if (stop_here(frame) || break_anywhere(frame)) {
-        user_call(frame);
+
+    return false;
+}
+
+PyFrameObject* bdb::user_caller(PyFrameObject* frame)
+{
+    // stop_here never stops in a library frame, so stepping out into one would run to the end
+    auto caller = frame->f_back;
+    while (_just_my_code && caller && is_library(caller->f_code)) {
+        caller = caller->f_back;
     }
-    else {
-        _ignored_frames.insert(frame);
-        return 0;
+
+    return caller;
+}
+
+bool bdb::is_library(PyCodeObject* code)
+{
+    if (auto cached = _library_code.find(code)) {
+        return *cached;
     }
 
-	if (_quitting) {
-		raiseException("quitting");
-		return -1;
-	}
+    const auto filename = canonic(PyString_AsString(code->co_filename));
+    const auto library = filename.contains(".zip") || std::ranges::any_of(_exclude_paths, [&](const auto& path) {
+        return filename.starts_with(path);
+    });
 
-    return 0;
+    return _library_code.emplace(code, library);
 }
 
-int bdb::dispatch_return(PyFrameObject* frame, PyObject* arg)
+bool bdb::in_scope(PyCodeObject* code)
 {
-    // scope_exit doesn't exist yet :(
-    // if the mainframe returns, no saved reference remains valid
-    // the reset must only happen after the scope exists, as we still need to check if we have to break
-    auto resetter = [&](void*) {
-        if (frame->f_back == nullptr) {
-            // return from the main frame = end of the program
-            reset();
-        }
-    };
-    auto reset_guard = std::unique_ptr<void, decltype(resetter)>(nullptr, resetter);
+    if (_trace_scope.empty()) {
+        return true;
+    }
 
-    auto it = _ignored_frames.find(frame);
-    if (it != _ignored_frames.end()) {
-        _ignored_frames.erase(it);
-        return 0;
+    if (auto cached = _scope_code.find(code)) {
+        return *cached;
     }
 
-    if (frame == _returnframe || stop_here(frame)) {
-        user_return(frame, arg);
-        if (_stopframe == frame) {
-            // cannot stop on this frame again, so stop on parent frame
-            _stopframe = frame->f_back;
+    // the globs are relative (mods/bf2/python/game/*), so they may match at any directory boundary of co_filename
+    const auto filename = normalize_glob(PyString_AsString(code->co_filename));
+    auto matches = [&](const std::string& glob) {
+        for (std::size_t pos = 0; pos != std::string::npos; pos = filename.find('/', pos + 1)) {
+            const auto start = pos == 0 && filename[0] != '/' ? 0 : pos + 1;
+            if (glob_match(glob, std::string_view{ filename }.substr(start))) {
+                return true;
+            }
         }
 
-        if (_quitting) {
-			raiseException("quitting");
-			return -1;
-        }
+        return false;
+    };
+    const auto scoped = filename.starts_with("<") || std::ranges::any_of(_trace_scope, matches);
+
+    return _scope_code.emplace(code, scoped);
+}
+
+bool bdb::scope_call(PyFrameObject* frame)
+{
+    // the coverage needs the line events of all code
+    if (_trace_scope.empty() || _coverage_enabled || in_scope(frame->f_code)) {
+        return false;
     }
 
-    return 0;
+    // the line events of this frame (and everything it calls outside of the scope) go to the call-only tracer
+    frame->f_tstate->c_tracefunc = trace_function_for(trace_kind::OUT_OF_SCOPE);
+    return true;
 }
 
-int bdb::dispatch_exception(PyFrameObject* frame, PyObject* exec)
+void bdb::scope_return(PyFrameObject* frame)
 {
-    if (
-        (_exmode & exception_mode::ALL_EXCEPTIONS)
-        || (_exmode & exception_mode::UNHANDLED_EXCEPTION && !is_cought(frame, exec))
-        || stop_here(frame)
-        ) {
-        user_exception(frame, exec);
+    if (!_trace_scope.empty() && !_coverage_enabled && frame->f_back && !in_scope(frame->f_back->f_code)) {
+        frame->f_tstate->c_tracefunc = trace_function_for(trace_kind::OUT_OF_SCOPE);
+    }
+}
 
-        if (_quitting) {
-            raiseException("quitting");
-            return -1;
+void bdb::set_trace_scope(const std::vector<std::string>& globs)
+{
+    _trace_scope.clear();
+    for (const auto& glob : globs) {
+        if (!glob.empty()) {
+            _trace_scope.push_back(normalize_glob(glob));
         }
     }
 
-    return 0;
+    _scope_code.clear();
+    update_trace();
 }
 
-bool bdb::stop_here(PyFrameObject* frame) const
+void bdb::set_just_my_code(bool enable, const std::vector<std::string>& excludePaths)
 {
-    if (_step || frame == _stopframe) {
-        return true;
+    _just_my_code = enable;
+    _exclude_paths.clear();
+    for (const auto& path : excludePaths) {
+        _exclude_paths.push_back(normalize_path(path));
     }
 
-    return false;
+    _library_code.clear();
+}
+
+bdb::code_breaks_t* bdb::code_breaks(PyCodeObject* code)
+{
+    if (auto cached = _code_breaks.find(code)) {
+        return cached->get();
+    }
+
+    std::unique_ptr<code_breaks_t> entry;
+    auto breakIter = _breaks.find(canonic(PyString_AsString(code->co_filename)));
+    if (breakIter != _breaks.end()) {
+        const auto table = line_table{ code };
+        const auto nested = table.nested_spans(code);
+        auto lines = line_bitset{ table.first_line(), table.last_line() };
+        auto snapped = decltype(code_breaks_t::snapped){};
+
+        for (const auto& [line, breaks] : breakIter->second) {
+            if (line < table.first_line() || line > table.last_line()) {
+                continue;
+            }
+
+            if (table.executable(line)) {
+                lines.set(line);
+            }
+            else if (!nested.test(line)) {
+                // blank lines, comments or continuation lines never generate a line event
+                if (auto executable = table.snap(line)) {
+                    lines.set(*executable);
+                    snapped.emplace(*executable, line);
+                }
+            }
+        }
+
+        // breakpoints in nested functions are handled by the nested code objects
+        if (lines.any()) {
+            entry.reset(new code_breaks_t{ &breakIter->second, std::move(lines), std::move(snapped) });
+        }
+    }
+
+    return _code_breaks.emplace(code, std::move(entry)).get();
 }
 
-bool bdb::break_here(PyFrameObject* frame)
+bool bdb::break_here(thread_state& ts, PyFrameObject* frame)
 {
-    const auto filename = canonic(PyString_AsString(frame->f_code->co_filename));
-    auto breakIter = _breaks.find(filename); 
-    if (breakIter == _breaks.end()) {
+    auto codeBreaks = code_breaks(frame->f_code);
+    if (!codeBreaks) {
         return false;
     }
 
-    // f_lineno has a getter in PyFrameObject's tp_getset 
+    // while tracing, the interpreter keeps f_lineno up to date (derived from f_lasti and co_lnotab)
     auto lineno = frame->f_lineno;
-    if (lineno < 0) {
+    if (!codeBreaks->lines.test(lineno)) {
         return false;
     }
 
-	auto& fileBreaks = breakIter->second;
+    auto& fileBreaks = *codeBreaks->breaks;
 	auto lineBreaksIter = fileBreaks.find(lineno);
     if (lineBreaksIter == fileBreaks.end()) {
-        return false;
+        auto snapIter = codeBreaks->snapped.find(lineno);
+        if (snapIter == codeBreaks->snapped.end()) {
+            return false;
+        }
+
+        lineBreaksIter = fileBreaks.find(snapIter->second);
+        if (lineBreaksIter == fileBreaks.end()) {
+            return false;
+        }
     }
 
     // check for effective breakpoint
@@ -380,26 +903,28 @@ bool bdb::break_here(PyFrameObject* frame)
 
         // Count every hit when bp is enabled
         bp->hits++;
-        if (!bp->condition.empty()) {
+        if (bp->code) {
             // Conditional bp.
             // Ignore count applies only to those bpt hits where the
             // condition evaluates to true.
-            _evaling = true;
-            const auto val = PyRun_String(bp->condition.c_str(), Py_eval_input, frame->f_globals, frame->f_locals);
-            _evaling = false;
+            const auto locals = eval_locals(frame);
+            ts.evaling = true;
+            PyNewRef val = PyEval_EvalCode(reinterpret_cast<PyCodeObject*>(static_cast<PyObject*>(bp->code)), frame->f_globals, locals);
+            ts.evaling = false;
             if (!val) {
                 // if eval fails, most conservative
                 // thing is to stop on breakpoint
                 // regardless of ignore count.
                 // Don't delete temporary,
                 // as another hint to user.
-                on_breakpoint_error(*bp, std::format("Error evaluating condition: {}", bp->condition));
+                on_breakpoint_error(*bp, std::format("Error evaluating condition '{}': {}", bp->condition, py_utils::fetch_error()));
                 return false;
             }
 
             const auto isTrue = PyObject_IsTrue(val);
             if (isTrue == -1) {
                 std::println(stderr, "Error casting value to true: {}", bp->condition);
+                PyErr_Clear();
                 return false;
             }
 
@@ -413,6 +938,11 @@ bool bdb::break_here(PyFrameObject* frame)
             continue;
         }
 
+        if (!bp->log.empty()) {
+            log_here(ts, frame, *bp);
+            continue;
+        }
+
         if (bp->temporary) {
             // Temporary breakpoints are deleted after first hit
             // and not re-enabled.
@@ -420,13 +950,198 @@ bool bdb::break_here(PyFrameObject* frame)
             do_clear(*bp);
         }
 
-        _currentbp = &(*bp);
+        ts.currentbp = &(*bp);
         return true;
     }
 
     return false;
 }
 
+void bdb::log_here(thread_state& ts, PyFrameObject* frame, Breakpoint& bp)
+{
+    ts.log_buffer.clear();
+    for (const auto& part : bp.log) {
+        if (!part.code) {
+            ts.log_buffer += part.text;
+            continue;
+        }
+
+        const auto locals = eval_locals(frame);
+        ts.evaling = true;
+        PyNewRef val = PyEval_EvalCode(reinterpret_cast<PyCodeObject*>(static_cast<PyObject*>(part.code)), frame->f_globals, locals);
+        ts.evaling = false;
+
+        PyNewRef str = val ? PyObject_Str(val) : nullptr;
+        if (!str) {
+            ts.log_buffer += std::format("<{}: {}>", part.text, py_utils::fetch_error());
+            continue;
+        }
+
+        ts.log_buffer.append(PyString_AS_STRING(static_cast<PyObject*>(str)), PyString_GET_SIZE(static_cast<PyObject*>(str)));
+    }
+
+    ts.log_buffer += '\n';
+    user_log(bp, ts.log_buffer);
+}
+
+std::expected<std::vector<Breakpoint::log_part>, std::string> bdb::compile_log_message(const std::string& message)
+{
+    std::vector<Breakpoint::log_part> parts;
+    std::string text;
+    for (std::size_t i = 0; i < message.size(); i++) {
+        const auto c = message[i];
+        if ((c == '{' || c == '}') && i + 1 < message.size() && message[i + 1] == c) {
+            text += c;
+            i++;
+            continue;
+        }
+
+        if (c != '{') {
+            text += c;
+            continue;
+        }
+
+        const auto end = message.find('}', i + 1);
+        if (end == std::string::npos) {
+            return std::unexpected(std::format("missing '}}' in log message: {}", message));
+        }
+
+        auto expression = message.substr(i + 1, end - i - 1);
+        auto code = py_utils::compile(expression, "<logpoint>", Py_eval_input);
+        if (!code) {
+            return std::unexpected(code.error());
+        }
+
+        if (!text.empty()) {
+            parts.push_back({ .text = std::move(text) });
+            text.clear();
+        }
+
+        // the expression is kept for error messages
+        parts.push_back({ .text = std::move(expression), .code = *code });
+        i = end;
+    }
+
+    if (!text.empty() || parts.empty()) {
+        parts.push_back({ .text = std::move(text) });
+    }
+
+    return parts;
+}
+
+const std::vector<std::size_t>& bdb::data_reach(PyCodeObject* code)
+{
+    if (auto cached = _data_reach.find(code)) {
+        return *cached;
+    }
+
+    // a name can only be rebound by code which mentions it: as a global/attribute name or as a constant (d['name'] = ...)
+    auto mentions = [code](PyObject* key) {
+        if (!PyString_Check(key)) {
+            return true;
+        }
+
+        for (auto tuple : { code->co_names, code->co_consts }) {
+            for (int i = 0, n = PyTuple_GET_SIZE(tuple); i < n; i++) {
+                auto item = PyTuple_GET_ITEM(tuple, i);
+                if (PyString_Check(item) && PyString_GET_SIZE(item) == PyString_GET_SIZE(key)
+                    && std::string_view{ PyString_AS_STRING(item) } == PyString_AS_STRING(key)) {
+                    return true;
+                }
+            }
+        }
+
+        return false;
+    };
+
+    std::vector<std::size_t> reach;
+    for (std::size_t i = 0; i < _data_breaks.size(); i++) {
+        auto& bp = _data_breaks[i];
+        if (bp.is_local() ? reinterpret_cast<PyFrameObject*>(static_cast<PyObject*>(bp.container))->f_code == code : mentions(bp.key)) {
+            reach.push_back(i);
+        }
+    }
+
+    return _data_reach.emplace(code, std::move(reach));
+}
+
+bool bdb::check_data_breaks(thread_state& ts, PyFrameObject* frame)
+{
+    // Note: changes are seen on the next line event of a code object which can reach the variable
+    for (auto i : data_reach(frame->f_code)) {
+        auto& bp = _data_breaks[i];
+        if (bp.is_local() && static_cast<PyObject*>(bp.container) != reinterpret_cast<PyObject*>(frame)) {
+            continue;
+        }
+
+        const auto current = DataBreakpoint::fingerprint::of(bp.value());
+        if (current != bp.last) {
+            bp.last = current;
+            bp.hits++;
+            ts.data_hit = &bp;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void bdb::set_data_breaks(std::vector<DataBreakpoint> breaks)
+{
+    _data_breaks = std::move(breaks);
+    _data_reach.clear();
+    update_trace();
+}
+
+FunctionBreakpoint* bdb::function_break(PyCodeObject* code)
+{
+    if (auto cached = _code_function_breaks.find(code)) {
+        return *cached;
+    }
+
+    FunctionBreakpoint* match = nullptr;
+    auto breaksIter = _function_breaks.find(PyString_AS_STRING(code->co_name));
+    if (breaksIter != _function_breaks.end()) {
+        const auto filename = std::string{ PyString_AS_STRING(code->co_filename) };
+        for (auto& bp : breaksIter->second) {
+            if (bp.matches(filename)) {
+                match = &bp;
+                break;
+            }
+        }
+    }
+
+    return _code_function_breaks.emplace(code, match);
+}
+
+bool bdb::function_break_here(thread_state& ts, PyFrameObject* frame)
+{
+    if (_function_breaks.empty()) {
+        return false;
+    }
+
+    auto bp = function_break(frame->f_code);
+    if (!bp) {
+        return false;
+    }
+
+    bp->hits++;
+    ts.function_hit = bp;
+    return true;
+}
+
+void bdb::set_function_breaks(std::vector<FunctionBreakpoint> breaks)
+{
+    _function_breaks.clear();
+    _code_function_breaks.clear();
+    for (auto& bp : breaks) {
+        auto function = bp.function;
+        _function_breaks[function].push_back(std::move(bp));
+    }
+
+    update_trace();
+}
+
 bool bdb::is_cought(PyFrameObject* frame, PyObject* exec)
 {
     for (auto f = frame; f; f = f->f_back) {
@@ -440,59 +1155,89 @@ bool bdb::is_cought(PyFrameObject* frame, PyObject* exec)
 
 bool bdb::break_anywhere(PyFrameObject* frame)
 {
-    const auto filename = canonic(PyString_AsString(frame->f_code->co_filename));
-    auto contains = _breaks.contains(filename);
-    return contains;
+    return code_breaks(frame->f_code) != nullptr;
 }
 
-void bdb::set_step()
+void bdb::set_step(thread_state& ts)
 {
     // exceptions can also occur in ignored frames, in this case "step into" must clear those
-    _ignored_frames.clear();
-    _step = true;
-    _returnframe = nullptr;
+    ts.ignored_frames.clear();
+    ts.step = true;
+    ts.returnframe = nullptr;
     _quitting = false;
 }
 
-void bdb::set_next(PyFrameObject* frame)
+void bdb::set_next(thread_state& ts, PyFrameObject* frame)
 {
-    _step = false;
-    _stopframe = frame;
-    _returnframe = nullptr;
+    ts.step = false;
+    ts.stopframe = frame;
+    ts.returnframe = nullptr;
     _quitting = false;
 }
 
-void bdb::set_return(PyFrameObject* frame)
+void bdb::set_return(thread_state& ts, PyFrameObject* frame)
 {
-    _step = false;
-    _stopframe = nullptr;
-    _returnframe = frame;
+    ts.step = false;
+    ts.stopframe = nullptr;
+    ts.returnframe = frame;
     _quitting = false;
 }
 
-void bdb::set_continue()
+void bdb::set_continue(thread_state& ts)
 {
-    _step = false;
-    _stopframe = nullptr;
-    _returnframe = nullptr;
+    ts.step = false;
+    ts.stopframe = nullptr;
+    ts.returnframe = nullptr;
     _quitting = false;
 }
 
 void bdb::set_quit()
 {
-    reset();
+    for (auto& [threadId, ts] : _thread_states) {
+        reset(*ts);
+    }
     _quitting = true;
 }
 
 void bdb::set_break(const std::string& _filename, line_t line, bool temporary, const std::string& cond)
 {
     const auto filename = canonic(_filename);
-    _breaks[filename][line].emplace_back(filename, line, temporary, cond);
+    auto& bp = _breaks[filename][line].emplace_back(filename, line, temporary, cond);
+    if (!cond.empty()) {
+        auto code = py_utils::compile(cond, "<condition>", Py_eval_input);
+        if (code) {
+            bp.code = *code;
+        }
+        else {
+            // a condition which doesn't compile would never be true
+            bp.enabled = false;
+            on_breakpoint_error(bp, std::format("Error compiling condition '{}': {}", cond, code.error()));
+        }
+    }
+
+    _code_breaks.clear();
+    patch_breakpoints();
+    update_trace();
+}
+
+void bdb::set_breaks(const std::string& filename, line_breaks_t breaks)
+{
+    if (breaks.empty()) {
+        _breaks.erase(filename);
+    }
+    else {
+        _breaks[filename] = std::move(breaks);
+    }
+
+    _code_breaks.clear();
+    patch_breakpoints();
+    update_trace();
 }
 
 void bdb::set_exception_mode(exception_mode exmode)
 {
     _exmode = exmode;
+    update_trace();
 }
 
 bdb::exception_mode operator|(bdb::exception_mode lhs, bdb::exception_mode rhs) {
@@ -1,24 +1,99 @@
 #pragma once
 #include "breakpoint.h"
+#include "code_patcher.h"
+#include "data_breakpoint.h"
+#include "flight_recorder.h"
+#include "function_breakpoint.h"
+#include "line_coverage.h"
+#include "line_table.h"
 #include "python.h"
+#include <array>
+#include <cstddef>
 #include <deque>
+#include <expected>
+#include <filesystem>
+#include <memory>
 #include <set>
 #include <string>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
 namespace bf2py {
+    // a value computed once per code object, e.g. the breakpoints indexed for it
+    // a freed code object's address might be reused by another code object, so the code objects are kept alive while cached
+    template<typename T>
+    class code_cache
+    {
+    public:
+        code_cache() = default;
+        code_cache(const code_cache&) = delete;
+        code_cache& operator=(const code_cache&) = delete;
+        ~code_cache() { clear(); }
+
+        T* find(PyCodeObject* code)
+        {
+            auto it = _values.find(code);
+            return it != _values.end() ? &it->second : nullptr;
+        }
+
+        T& emplace(PyCodeObject* code, T value)
+        {
+            // exec'd code creates new code objects all the time, don't let the cache grow without bounds
+            if (_values.size() >= max_size) {
+                clear();
+            }
+
+            Py_INCREF(code);
+            return _values.emplace(code, std::move(value)).first->second;
+        }
+
+        void clear()
+        {
+            // the debugger might be destructed after Py_Finalize was called
+            if (Py_IsInitialized()) {
+                for (auto& [code, value] : _values) {
+                    Py_DECREF(code);
+                }
+            }
+
+            _values.clear();
+        }
+
+    private:
+        static constexpr std::size_t max_size = 0x10000;
+        std::unordered_map<PyCodeObject*, T> _values;
+    };
+
     class bdb
     {
-        std::set<PyFrameObject*> _ignored_frames;
-        bool _evaling = false;
-        bool _step = false;
-        PyFrameObject* _stopframe = nullptr;
-        PyFrameObject* _returnframe = nullptr;
+    public:
+        // the stepping state of one python thread, found by the trace function via the thread's own trace object (c_traceobj)
+        struct thread_state {
+            long thread_id = 0;
+            bool step = false;
+            PyFrameObject* stopframe = nullptr;
+            PyFrameObject* returnframe = nullptr;
+            std::set<PyFrameObject*> ignored_frames;
+            PyObject* trace_obj = nullptr; // strong reference
+            flight_recorder recorder; // only enabled with enable_recorder, kept when the thread id is reused
+
+            // the event being handled, per thread: evaluating python code (conditions, logpoints) may switch to another thread
+            bool evaling = false; // running python code on behalf of the debugger, which must not be traced
+            Breakpoint* currentbp = nullptr;
+            DataBreakpoint* data_hit = nullptr; // the data breakpoint which caused the current stop
+            FunctionBreakpoint* function_hit = nullptr; // the function breakpoint which caused the current stop
+            std::string log_buffer; // reused for every logpoint message
+        };
+
+    private:
+        // only accessed while holding the GIL
+        std::unordered_map<long, std::unique_ptr<thread_state>> _thread_states;
         std::unordered_map<std::string, std::string> _fncache;
 
     public:
         using line_t = Breakpoint::line_t;
+        using line_breaks_t = std::unordered_map<line_t, std::vector<Breakpoint>>;
         static std::string normalize_path(const std::string& filename);
 
         enum class exception_mode : unsigned char {
@@ -28,15 +103,147 @@ namespace bf2py {
             ALL_EXCEPTIONS = 3
         };
 
+        // TRACE: breakpoints are checked by the trace function on every line event
+        // CODE_PATCH: breakpoints are compiled into the affected functions (see code_patcher),
+        //             the trace function is only installed while stepping or when exceptions must be caught
+        enum class breakpoint_engine : unsigned char {
+            TRACE,
+            CODE_PATCH
+        };
+
+        // the trace function installed via PyEval_SetTrace is specialized for the current stepping state,
+        // so the hot path (RUNNING) only checks for breakpoints and never touches ignored_frames
+        // DISPATCH: generic, calls the virtual trace_dispatch
+        // RUNNING: no step pending, only breakpoints, exceptions and the entry are handled
+        // STEPPING: step into (every event may stop), uses the generic dispatch_*
+        // STEP_OVER: step over/out, only wakes up in stopframe/returnframe or on breakpoints
+        // COVERAGE: only records the executed lines (coverage enabled, nothing to debug)
+        // RECORDING: only feeds the flight recorder (nothing to debug)
+        // OUT_OF_SCOPE: installed while the thread runs code outside the trace scope, only watches for calls back into the scope
+        enum class trace_kind : unsigned char {
+            DISPATCH,
+            RUNNING,
+            STEPPING,
+            STEP_OVER,
+            COVERAGE,
+            RECORDING,
+            OUT_OF_SCOPE
+        };
+
+        // the trace object of a thread (c_traceobj), the threading.settrace callable has no state
+        struct trace_object : PyObject {
+            bdb* debugger;
+            thread_state* state;
+        };
+
         static std::pair<std::deque<std::pair<PyFrameObject*, std::size_t>>, std::size_t> get_stack(PyFrameObject* frame, PyObject* traceback);
+        // splits a logpoint message into text and {expression} parts ({{ and }} are literal braces)
+        static std::expected<std::vector<Breakpoint::log_part>, std::string> compile_log_message(const std::string& message);
 
     protected:
         PyObject* _pyDebugger = nullptr;
         bool _quitting = false;
-        Breakpoint* _currentbp = nullptr;
-        std::unordered_map<std::string, std::unordered_map<line_t, std::vector<Breakpoint>>> _breaks;
+        bool _attached = false; // a client is attached (see attach/detach)
+        bool _entry_pending = true; // user_entry still has to stop on the first call
+        bool _force_trace = false; // keep the trace function installed even if nothing needs it (benchmarks)
+        bool _postmortem = false; // unhandled exceptions reach user_exception even without a client
+        std::unordered_map<std::string, line_breaks_t> _breaks;
         exception_mode _exmode = exception_mode::NEVER;
 
+        // trace callbacks (and breakpoint hook calls) in progress on any thread, GIL protected:
+        // while one runs, the state it iterates (e.g. the breakpoints while a condition is evaluated) must not be changed by others
+        std::size_t _callbacks = 0;
+        bool _notify_idle = false; // user_idle is called once _callbacks drops to 0
+
+        struct callback_scope {
+            bdb& debugger;
+
+            explicit callback_scope(bdb& debugger) : debugger(debugger) { debugger._callbacks++; }
+            ~callback_scope()
+            {
+                if (--debugger._callbacks == 0 && debugger._notify_idle) {
+                    debugger._notify_idle = false;
+                    debugger.user_idle();
+                }
+            }
+        };
+
+    private:
+        struct code_breaks_t {
+            line_breaks_t* breaks;
+            line_bitset lines; // executable lines of the code object with a breakpoint
+            std::unordered_map<line_t, line_t> snapped; // executable line -> non-executable breakpoint line moved onto it
+        };
+
+        // lazily built index of _breaks for every code object seen since the breakpoints last changed
+        // (nullptr = this code object can never break)
+        code_cache<std::unique_ptr<code_breaks_t>> _code_breaks;
+
+        bool _coverage_enabled = false;
+        line_coverage _coverage;
+
+        // events kept per thread (0 = off), written to _recorder_path when an exception leaves the outermost frame
+        std::size_t _recorder_capacity = 0;
+        std::filesystem::path _recorder_path;
+
+        // watched variables, and for every code object seen since they last changed the ones it can modify
+        std::vector<DataBreakpoint> _data_breaks;
+        code_cache<std::vector<std::size_t>> _data_reach;
+
+        // function breakpoints by co_name, and the one matching each code object called since they last changed
+        std::unordered_map<std::string, std::vector<FunctionBreakpoint>> _function_breaks;
+        code_cache<FunctionBreakpoint*> _code_function_breaks;
+
+        // justMyCode: stepping never stops in library code (pylib zip or below an excluded path), decided once per code object
+        bool _just_my_code = false;
+        std::vector<std::string> _exclude_paths; // normalized
+        code_cache<bool> _library_code;
+
+        // path globs of the code which is debugged at all (empty = everything), decided once per code object
+        std::vector<std::string> _trace_scope;
+        code_cache<bool> _scope_code;
+
+        // the trace function of every trace_kind, instantiated for the final class (see use_host)
+        using trace_functions_t = std::array<Py_tracefunc, static_cast<std::size_t>(trace_kind::OUT_OF_SCOPE) + 1>;
+        const trace_functions_t* _trace_functions;
+
+        breakpoint_engine _engine = breakpoint_engine::TRACE;
+        code_patcher _patcher;
+        PyObject* _pyBreakpointHook = nullptr;
+        PyObject* _pyImportHook = nullptr;
+        int _import_depth = 0;
+        // files with breakpoints but no patched function yet, and the number of modules when they were last patched
+        std::set<std::string> _unpatched_files;
+        int _patched_modules = 0;
+
+        code_breaks_t* code_breaks(PyCodeObject* code);
+        const std::vector<std::size_t>& data_reach(PyCodeObject* code);
+        bool check_data_breaks(thread_state& ts, PyFrameObject* frame);
+        FunctionBreakpoint* function_break(PyCodeObject* code);
+        bool is_library(PyCodeObject* code);
+        // the frame a step continues in after frame returned: its caller, with just my code the first caller which isn't library code
+        PyFrameObject* user_caller(PyFrameObject* frame);
+        bool in_scope(PyCodeObject* code);
+        // switch the thread between the call-only OUT_OF_SCOPE tracer and the regular one
+        bool scope_call(PyFrameObject* frame);
+        void scope_return(PyFrameObject* frame);
+        void patch_breakpoints();
+        void install_import_hook();
+        // the outermost __import__ returned (CODE_PATCH)
+        void imported();
+        void write_recorder(thread_state& ts, PyObject* excInfo);
+        Py_tracefunc trace_function_for(trace_kind kind) const { return (*_trace_functions)[static_cast<std::size_t>(kind)]; }
+        // true if tracefunc is one of the tracers which handle the line events of breakpoints themselves (not COVERAGE, RECORDING, OUT_OF_SCOPE)
+        bool checks_breakpoints(Py_tracefunc tracefunc) const;
+        template<typename Host, trace_kind kind>
+        static int trace_function(PyObject* obj, PyFrameObject* frame, int event, PyObject* arg);
+        template<typename Host>
+        static const trace_functions_t& trace_functions();
+        // the threading.settrace callable (nullptr) or the trace object of a thread
+        PyObject* py_debugger(thread_state* ts = nullptr);
+        // needs_trace without coverage
+        bool needs_debug_trace() const;
+
     protected:
         virtual void user_entry(PyFrameObject* frame) = 0;
         virtual void user_call(PyFrameObject* frame) = 0;
@@ -45,42 +252,119 @@ namespace bf2py {
         virtual void user_exception(PyFrameObject* frame, PyObject* arg) = 0;
         virtual void do_clear(Breakpoint& bp) = 0;
         virtual void on_breakpoint_error(Breakpoint& bp, const std::string& msg) = 0;
+        // a logpoint was hit (the message is only valid during the call)
+        virtual void user_log(Breakpoint& bp, const std::string& message) = 0;
+        // no callback is in progress anymore (after _notify_idle was set)
+        virtual void user_idle() {}
 
-        void reset();
+        void reset(thread_state& ts);
         void raiseException(const std::string& message);
 
+        virtual trace_kind select_trace(const thread_state& ts) const;
+
+        // the per-event path (see bdb_trace.h) calls the hooks through Host instead of the vtable,
+        // a final subclass which calls this in its constructor gets them inlined (Host needs to befriend bdb)
+        template<typename Host>
+        void use_host() { _trace_functions = &trace_functions<Host>(); }
+        template<typename Host>
+        Host& host() { return static_cast<Host&>(*this); }
+
     public:
         bdb();
         ~bdb();
 
         static bool pyInit();
 
+        // installs the trace function on the current thread
         bool enable_trace();
         bool enable_thread_trace();
         void disable_trace();
-        bool trace_ignore() const { return _evaling || _quitting; }
+        bool trace_ignore(const thread_state& ts) const { return ts.evaling || _quitting; }
+
+        // the engine must be selected before breakpoints are set
+        void set_engine(breakpoint_engine engine) { _engine = engine; }
+        auto engine() const { return _engine; }
+
+        // the trace function is only installed while it is needed:
+        // for the entry stop, or while a client is attached with breakpoints, exception filters or a pending step/pause
+        bool needs_trace() const;
+        // installs or removes the trace function on all threads, depending on needs_trace
+        void update_trace();
+
+        void force_trace(bool force) { _force_trace = force; }
+
+        // while no client is attached, exceptions leaving the outermost frame unhandled are passed to user_exception
+        // (keeps the trace function installed)
+        void set_postmortem(bool enable);
+
+        // records the executed lines of all code objects while enabled (keeps the trace function installed)
+        void enable_coverage(bool enable);
+        auto& coverage() { return _coverage; }
+
+        // keeps the last trace events of every thread in a ring buffer (0 = off), see flight_recorder
+        void enable_recorder(std::size_t capacity, const std::filesystem::path& crashPath = "bf2py-flight.log");
+        auto recorder_capacity() const { return _recorder_capacity; }
+        // the last n events of all threads, oldest first
+        std::vector<flight_recorder::entry> recorded_events(std::size_t n) const;
+
+        void attach();
+        // removes all breakpoints, exception filters and steps
+        void detach();
 
         std::string canonic(const std::string& filename);
 
-        virtual int trace_dispatch(PyFrameObject* frame, int event, PyObject* arg);
-        virtual int dispatch_line(PyFrameObject* frame);
-        virtual int dispatch_call(PyFrameObject* frame);
-        virtual int dispatch_return(PyFrameObject* frame, PyObject* arg);
-        virtual int dispatch_exception(PyFrameObject* frame, PyObject* arg);
+        // the state of a python thread (created on first use)
+        thread_state& thread(long threadId);
+        thread_state* find_thread(long threadId);
+
+        // the virtual interface, the same as dispatch<bdb> and dispatch_*<bdb>
+        // ts is the state of the thread which generated the event
+        virtual int trace_dispatch(thread_state& ts, PyFrameObject* frame, int event, PyObject* arg);
+        virtual int dispatch_line(thread_state& ts, PyFrameObject* frame);
+        virtual int dispatch_call(thread_state& ts, PyFrameObject* frame);
+        virtual int dispatch_return(thread_state& ts, PyFrameObject* frame, PyObject* arg);
+        virtual int dispatch_exception(thread_state& ts, PyFrameObject* frame, PyObject* arg);
+
+        // defined in bdb_trace.h
+        template<typename Host, trace_kind kind>
+        int trace(thread_state& ts, PyFrameObject* frame, int event, PyObject* arg);
+        template<typename Host>
+        int dispatch(thread_state& ts, PyFrameObject* frame, int event, PyObject* arg);
+        template<typename Host>
+        int dispatch_line(thread_state& ts, PyFrameObject* frame);
+        template<typename Host>
+        int dispatch_call(thread_state& ts, PyFrameObject* frame);
+        template<typename Host>
+        int dispatch_return(thread_state& ts, PyFrameObject* frame, PyObject* arg);
+        template<typename Host>
+        int dispatch_exception(thread_state& ts, PyFrameObject* frame, PyObject* arg);
+        // called by the patched code objects of the CODE_PATCH engine
+        int dispatch_breakpoint(PyFrameObject* frame, line_t line);
 
-        bool stop_here(PyFrameObject* frame) const;
-        bool break_here(PyFrameObject* frame);
+        bool stop_here(thread_state& ts, PyFrameObject* frame);
+        bool break_here(thread_state& ts, PyFrameObject* frame);
+        void log_here(thread_state& ts, PyFrameObject* frame, Breakpoint& bp);
         bool is_cought(PyFrameObject* frame, PyObject* exception);
         bool break_anywhere(PyFrameObject* frame);
+        // only checked on call events
+        bool function_break_here(thread_state& ts, PyFrameObject* frame);
+        // a watched variable reachable from this frame's code changed since the last check
+        bool data_changed(thread_state& ts, PyFrameObject* frame) { return !_data_breaks.empty() && check_data_breaks(ts, frame); }
 
-        void pause();
-        void set_step();
-        void set_next(PyFrameObject* frame);
-        void set_return(PyFrameObject* frame);
-        void set_continue();
+        void pause(long threadId);
+        void set_step(thread_state& ts);
+        void set_next(thread_state& ts, PyFrameObject* frame);
+        void set_return(thread_state& ts, PyFrameObject* frame);
+        void set_continue(thread_state& ts);
         void set_quit();
         void set_break(const std::string& filename, line_t line, bool temporary = false, const std::string& cond = "");
+        void set_breaks(const std::string& filename, line_breaks_t breaks);
         void set_exception_mode(exception_mode exmode);
+        void set_data_breaks(std::vector<DataBreakpoint> breaks);
+        void set_function_breaks(std::vector<FunctionBreakpoint> breaks);
+        void set_just_my_code(bool enable, const std::vector<std::string>& excludePaths = {});
+        // globs like mods/bf2/python/game/*, matched against the end of co_filename
+        void set_trace_scope(const std::vector<std::string>& globs);
     };
 }
 
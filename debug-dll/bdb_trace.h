@@ -0,0 +1,281 @@
+#pragma once
+#include "bdb.h"
+
+// the per-event path of bdb, instantiated for the class which handles the events (see bdb::use_host):
+// with Host = bdb the user_* hooks are virtual calls, with a final Host they are direct calls which can be inlined
+
+namespace bf2py {
+template<typename Host, bdb::trace_kind kind>
+inline int bdb::trace_function(PyObject* obj, PyFrameObject* frame, int event, PyObject* arg)
+{
+    auto self = static_cast<trace_object*>(obj);
+    callback_scope scope{ *self->debugger };
+    return self->debugger->trace<Host, kind>(*self->state, frame, event, arg);
+}
+
+template<typename Host>
+inline const bdb::trace_functions_t& bdb::trace_functions()
+{
+    // indexed by trace_kind
+    static constexpr trace_functions_t functions = {
+        trace_function<Host, trace_kind::DISPATCH>,
+        trace_function<Host, trace_kind::RUNNING>,
+        trace_function<Host, trace_kind::STEPPING>,
+        trace_function<Host, trace_kind::STEP_OVER>,
+        trace_function<Host, trace_kind::COVERAGE>,
+        trace_function<Host, trace_kind::RECORDING>,
+        trace_function<Host, trace_kind::OUT_OF_SCOPE>
+    };
+
+    return functions;
+}
+
+template<typename Host>
+inline int bdb::dispatch(thread_state& ts, PyFrameObject* frame, int event, PyObject* arg)
+{
+    if (trace_ignore(ts)) {
+        // evaluating a breakpoint condition - always happens recuresively
+        return 0;
+    }
+
+    ts.currentbp = nullptr;
+    ts.data_hit = nullptr;
+    ts.function_hit = nullptr;
+
+    switch (event) {
+    case PyTrace_CALL: return dispatch_call<Host>(ts, frame);
+    case PyTrace_EXCEPTION: return dispatch_exception<Host>(ts, frame, arg);
+    case PyTrace_LINE: return dispatch_line<Host>(ts, frame);
+    case PyTrace_RETURN: return dispatch_return<Host>(ts, frame, arg);
+    }
+
+    return 0;
+}
+
+template<typename Host, bdb::trace_kind kind>
+inline int bdb::trace(thread_state& ts, PyFrameObject* frame, int event, PyObject* arg)
+{
+    if (_recorder_capacity && !ts.evaling) {
+        ts.recorder.record(frame, event);
+
+        // the exception event is generated for every frame it passes, the outermost one tells that it isn't handled
+        if (event == PyTrace_EXCEPTION && !frame->f_back && !is_cought(frame, arg)) {
+            write_recorder(ts, arg);
+        }
+    }
+
+    if constexpr (kind != trace_kind::COVERAGE) {
+        if (_coverage_enabled) {
+            _coverage.record(frame, event);
+        }
+    }
+
+    if constexpr (kind == trace_kind::COVERAGE) {
+        _coverage.record(frame, event);
+        return 0;
+    }
+    else if constexpr (kind == trace_kind::RECORDING) {
+        return 0;
+    }
+    else if constexpr (kind == trace_kind::OUT_OF_SCOPE) {
+        // line and exception events of out of scope code end up here and are dropped right away
+        if (event == PyTrace_CALL && in_scope(frame->f_code)) {
+            auto traceFunction = trace_function_for(host<Host>().select_trace(ts));
+            frame->f_tstate->c_tracefunc = traceFunction;
+            return traceFunction(frame->f_tstate->c_traceobj, frame, event, arg);
+        }
+
+        if (event == PyTrace_RETURN) {
+            if (frame == ts.stopframe) {
+                ts.stopframe = user_caller(frame);
+            }
+
+            if (frame->f_back && in_scope(frame->f_back->f_code)) {
+                frame->f_tstate->c_tracefunc = trace_function_for(host<Host>().select_trace(ts));
+            }
+        }
+
+        return 0;
+    }
+    else if constexpr (kind == trace_kind::DISPATCH) {
+        return host<Host>().trace_dispatch(ts, frame, event, arg);
+    }
+    else if constexpr (kind == trace_kind::STEPPING) {
+        return dispatch<Host>(ts, frame, event, arg);
+    }
+    else {
+        if (trace_ignore(ts)) {
+            return 0;
+        }
+
+        switch (event) {
+        case PyTrace_CALL:
+            // functions called from here can only stop on breakpoints, which is checked by their line events
+            if (_entry_pending && frame->f_back == nullptr) {
+                host<Host>().user_entry(frame);
+                break;
+            }
+
+            if (scope_call(frame)) {
+                return 0;
+            }
+
+            ts.function_hit = nullptr;
+            if (function_break_here(ts, frame)) {
+                host<Host>().user_call(frame);
+                break;
+            }
+            return 0;
+        case PyTrace_LINE:
+            ts.currentbp = nullptr;
+            ts.data_hit = nullptr;
+            if constexpr (kind == trace_kind::STEP_OVER) {
+                if (frame != ts.stopframe && !break_here(ts, frame) && !data_changed(ts, frame)) {
+                    return 0;
+                }
+            }
+            else if (!break_here(ts, frame) && !data_changed(ts, frame)) {
+                return 0;
+            }
+
+            host<Host>().user_line(frame);
+            break;
+        case PyTrace_RETURN:
+            scope_return(frame);
+            if constexpr (kind == trace_kind::STEP_OVER) {
+                if (frame == ts.returnframe || frame == ts.stopframe) {
+                    host<Host>().user_return(frame, arg);
+                    if (ts.stopframe == frame) {
+                        // cannot stop on this frame again, so stop on parent frame
+                        ts.stopframe = user_caller(frame);
+                    }
+                }
+
+                if (frame->f_back == nullptr) {
+                    // return from the main frame = end of the program
+                    reset(ts);
+                }
+                break;
+            }
+            return 0;
+        case PyTrace_EXCEPTION:
+            return dispatch_exception<Host>(ts, frame, arg);
+        default:
+            return 0;
+        }
+
+        if (_quitting) {
+            raiseException("quitting");
+            return -1;
+        }
+
+        return 0;
+    }
+}
+
+template<typename Host>
+inline int bdb::dispatch_line(thread_state& ts, PyFrameObject* frame)
+{
+    if (ts.ignored_frames.contains(frame)) {
+        return 0;
+    }
+
+    if (stop_here(ts, frame) || break_here(ts, frame) || data_changed(ts, frame)) {
+        host<Host>().user_line(frame);
+
+        if (_quitting) {
+            raiseException("quitting");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+template<typename Host>
+inline int bdb::dispatch_call(thread_state& ts, PyFrameObject* frame)
+{
+    // once the entry stopped, top-level frames (e.g. every thread's first) are checked like all others
+    if (_entry_pending && frame->f_back == nullptr) {
+        host<Host>().user_entry(frame);
+    }
+    else if (scope_call(frame)) {
+        return 0;
+    }
+    else if (stop_here(ts, frame) || function_break_here(ts, frame) || break_anywhere(frame)) {
+        host<Host>().user_call(frame);
+    }
+    else if (!data_reach(frame->f_code).empty()) {
+        // its line events check the watched variables
+        return 0;
+    }
+    else {
+        ts.ignored_frames.insert(frame);
+        return 0;
+    }
+
+	if (_quitting) {
+		raiseException("quitting");
+		return -1;
+	}
+
+    return 0;
+}
+
+template<typename Host>
+inline int bdb::dispatch_return(thread_state& ts, PyFrameObject* frame, PyObject* arg)
+{
+    // scope_exit doesn't exist yet :(
+    // if the mainframe returns, no saved reference remains valid
+    // the reset must only happen after the scope exists, as we still need to check if we have to break
+    auto resetter = [&](void*) {
+        if (frame->f_back == nullptr) {
+            // return from the main frame = end of the program
+            reset(ts);
+        }
+    };
+    auto reset_guard = std::unique_ptr<void, decltype(resetter)>(nullptr, resetter);
+    scope_return(frame);
+
+    auto it = ts.ignored_frames.find(frame);
+    if (it != ts.ignored_frames.end()) {
+        ts.ignored_frames.erase(it);
+        return 0;
+    }
+
+    if (frame == ts.returnframe || stop_here(ts, frame)) {
+        host<Host>().user_return(frame, arg);
+        if (ts.stopframe == frame) {
+            // cannot stop on this frame again, so stop on parent frame
+            ts.stopframe = user_caller(frame);
+        }
+
+        if (_quitting) {
+			raiseException("quitting");
+			return -1;
+        }
+    }
+
+    return 0;
+}
+
+template<typename Host>
+inline int bdb::dispatch_exception(thread_state& ts, PyFrameObject* frame, PyObject* exec)
+{
+    if (
+        (_exmode & exception_mode::ALL_EXCEPTIONS)
+        || (_exmode & exception_mode::UNHANDLED_EXCEPTION && !is_cought(frame, exec))
+        || stop_here(ts, frame)
+        || (_postmortem && !_attached && !frame->f_back && !is_cought(frame, exec))
+        ) {
+        host<Host>().user_exception(frame, exec);
+
+        if (_quitting) {
+            raiseException("quitting");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+}
@@ -1,6 +1,8 @@
 #pragma once
+#include "python.h"
 #include <string>
 #include <cstdint>
+#include <vector>
 
 struct Breakpoint
 {
@@ -11,6 +13,16 @@ struct Breakpoint
     const bool temporary;
     const std::string condition;
 
+    // the condition compiled once when the breakpoint is set (empty if there is no condition)
+    bf2py::PyNewRef code;
+
+    // logpoints don't stop, they print their message: literal text and {expressions} compiled once
+    struct log_part {
+        std::string text;
+        bf2py::PyNewRef code;
+    };
+    std::vector<log_part> log;
+
     std::string command;
     bool enabled = true;
 
@@ -0,0 +1,318 @@
+#include "code_patcher.h"
+#include <opcode.h>
+#include <algorithm>
+#include <print>
+#include <set>
+#include <string>
+using namespace bf2py;
+
+namespace {
+    bool is_relative_jump(int op)
+    {
+        switch (op) {
+        case FOR_ITER:
+        case JUMP_FORWARD:
+        case SETUP_LOOP:
+        case SETUP_EXCEPT:
+        case SETUP_FINALLY:
+#ifdef JUMP_IF_FALSE
+        case JUMP_IF_FALSE:
+        case JUMP_IF_TRUE:
+#endif
+#ifdef SETUP_WITH
+        case SETUP_WITH:
+#endif
+            return true;
+        }
+
+        return false;
+    }
+
+    bool is_absolute_jump(int op)
+    {
+        switch (op) {
+        case JUMP_ABSOLUTE:
+        case CONTINUE_LOOP:
+#ifdef POP_JUMP_IF_FALSE
+        case POP_JUMP_IF_FALSE:
+        case POP_JUMP_IF_TRUE:
+        case JUMP_IF_FALSE_OR_POP:
+        case JUMP_IF_TRUE_OR_POP:
+#endif
+            return true;
+        }
+
+        return false;
+    }
+
+    std::set<int> jump_targets(const unsigned char* code, int size)
+    {
+        std::set<int> targets;
+        int extendedArg = 0;
+        for (int i = 0; i < size; ) {
+            const int op = code[i];
+            if (!HAS_ARG(op)) {
+                i += 1;
+                continue;
+            }
+
+            const int arg = code[i + 1] | (code[i + 2] << 8) | extendedArg;
+            extendedArg = op == EXTENDED_ARG ? arg << 16 : 0;
+            i += 3;
+
+            if (is_relative_jump(op)) {
+                targets.insert(i + arg);
+            }
+            else if (is_absolute_jump(op)) {
+                targets.insert(arg);
+            }
+        }
+
+        return targets;
+    }
+
+    void emit(std::string& code, int op, int arg)
+    {
+        code += static_cast<char>(op);
+        code += static_cast<char>(arg & 0xFF);
+        code += static_cast<char>((arg >> 8) & 0xFF);
+    }
+}
+
+code_patcher::~code_patcher()
+{
+    restore();
+}
+
+std::size_t code_patcher::apply(PyObject* hook, const lines_fn& lines)
+{
+    restore();
+
+    PyNewRef gcModule = PyImport_ImportModule((char*)"gc");
+    if (!gcModule) {
+        std::println(stderr, "[debugger] failed to import gc, breakpoints can't be patched");
+        PyErr_Clear();
+        return 0;
+    }
+
+    PyNewRef objects = PyObject_CallMethod(gcModule, (char*)"get_objects", nullptr);
+    if (!objects || !PyList_Check(objects)) {
+        std::println(stderr, "[debugger] gc.get_objects failed, breakpoints can't be patched");
+        PyErr_Clear();
+        return 0;
+    }
+
+    PyObject* list = objects;
+    for (int i = 0, n = PyList_GET_SIZE(list); i < n; i++) {
+        auto obj = PyList_GET_ITEM(list, i);
+        if (!PyFunction_Check(obj)) {
+            continue;
+        }
+
+        // a function created from the co_consts of an earlier patch is patched (or restored) based on its original code
+        auto function = reinterpret_cast<PyFunctionObject*>(obj);
+        auto current = function->func_code;
+        auto code = current;
+        if (auto it = _originals.find(reinterpret_cast<PyCodeObject*>(current)); it != _originals.end()) {
+            code = it->second.original;
+        }
+
+        auto patched = patch(reinterpret_cast<PyCodeObject*>(code), hook, lines);
+        auto target = patched ? patched : code;
+        if (target != current) {
+            Py_INCREF(target);
+            function->func_code = target;
+            Py_DECREF(current);
+        }
+
+        if (patched) {
+            Py_INCREF(obj);
+            Py_INCREF(code);
+            _functions.emplace_back(obj, code);
+        }
+    }
+
+    // forget the patched code objects which are no longer used by any function or co_consts (only referenced by _originals),
+    // nested ones are released by their parents, so repeat until nothing changes
+    for (auto erased = true; erased; ) {
+        erased = std::erase_if(_originals, [](const auto& entry) { return entry.first->ob_refcnt == 1; }) > 0;
+    }
+
+    return _functions.size();
+}
+
+void code_patcher::restore()
+{
+    // the patcher might be destructed after Py_Finalize was called
+    if (Py_IsInitialized()) {
+        for (auto& [function, original] : _functions) {
+            auto fn = reinterpret_cast<PyFunctionObject*>(static_cast<PyObject*>(function));
+            auto it = _patched.find(reinterpret_cast<PyCodeObject*>(static_cast<PyObject*>(original)));
+
+            // func_code might have been replaced by someone else in the meantime (e.g. a reload)
+            if (it != _patched.end() && fn->func_code == static_cast<PyObject*>(it->second.patched)) {
+                Py_DECREF(fn->func_code);
+                Py_INCREF(original);
+                fn->func_code = original;
+            }
+        }
+    }
+
+    _functions.clear();
+    _patched.clear();
+}
+
+PyObject* code_patcher::patch(PyCodeObject* code, PyObject* hook, const lines_fn& lines)
+{
+    auto it = _patched.find(code);
+    if (it != _patched.end()) {
+        return it->second.patched;
+    }
+
+    // nested code objects (inner functions, lambdas, class bodies) are replaced in co_consts,
+    // so functions which are created after apply() use the patched code as well
+    PyNewRef consts;
+    const auto constsSize = PyTuple_GET_SIZE(code->co_consts);
+    for (int i = 0; i < constsSize; i++) {
+        auto item = PyTuple_GET_ITEM(code->co_consts, i);
+        if (!PyCode_Check(item)) {
+            continue;
+        }
+
+        auto nested = patch(reinterpret_cast<PyCodeObject*>(item), hook, lines);
+        if (!nested) {
+            continue;
+        }
+
+        if (!consts) {
+            // Note: PyTuple_GetSlice would return the very same tuple
+            consts = PyTuple_New(constsSize);
+            for (int j = 0; j < constsSize; j++) {
+                auto constItem = PyTuple_GET_ITEM(code->co_consts, j);
+                Py_INCREF(constItem);
+                PyTuple_SET_ITEM(static_cast<PyObject*>(consts), j, constItem);
+            }
+        }
+
+        Py_DECREF(PyTuple_GET_ITEM(static_cast<PyObject*>(consts), i));
+        Py_INCREF(nested);
+        PyTuple_SET_ITEM(static_cast<PyObject*>(consts), i, nested);
+    }
+
+    PyObject* patched = nullptr;
+    auto codeLines = lines(code);
+    if (codeLines || consts) {
+        patched = build(code, hook, codeLines, consts ? static_cast<PyObject*>(consts) : code->co_consts);
+    }
+
+    if (patched) {
+        Py_INCREF(code);
+        Py_INCREF(patched);
+        _originals.emplace(reinterpret_cast<PyCodeObject*>(patched), patched_code{ reinterpret_cast<PyObject*>(code), patched });
+    }
+
+    Py_INCREF(code);
+    _patched.emplace(code, patched_code{ reinterpret_cast<PyObject*>(code), patched });
+    return patched;
+}
+
+PyObject* code_patcher::build(PyCodeObject* code, PyObject* hook, const line_bitset* lines, PyObject* consts)
+{
+    const auto original = reinterpret_cast<const unsigned char*>(PyString_AS_STRING(code->co_code));
+    const auto size = static_cast<int>(PyString_GET_SIZE(code->co_code));
+    const auto constsBase = static_cast<int>(PyTuple_GET_SIZE(consts));
+
+    auto bytes = std::string(reinterpret_cast<const char*>(original), size);
+    auto extraConsts = std::vector<PyNewRef>{};
+
+    if (lines) {
+        const auto targets = jump_targets(original, size);
+        const auto table = line_table{ code };
+        int patchedUntil = 0;
+
+        for (const auto& range : table.ranges()) {
+            if (!lines->test(range.line)) {
+                continue;
+            }
+
+            // the instructions which are displaced by the 3 byte JUMP_ABSOLUTE must be executable from the stub:
+            // no relative jumps and nothing in between may be jumped to
+            const int start = range.start;
+            int end = start;
+            bool relocatable = start >= patchedUntil;
+            while (relocatable && end - start < 3) {
+                if (end >= size) {
+                    relocatable = false;
+                    break;
+                }
+
+                const int op = original[end];
+                if (is_relative_jump(op) || op == EXTENDED_ARG || (end != start && targets.contains(end))) {
+                    relocatable = false;
+                }
+
+                end += HAS_ARG(op) ? 3 : 1;
+            }
+
+            const int hookIndex = constsBase;
+            const int lineIndex = constsBase + static_cast<int>(std::max<std::size_t>(extraConsts.size(), 1));
+            const int stub = static_cast<int>(bytes.size());
+            if (!relocatable || stub + 10 + (end - start) + 3 > 0xFFFF || lineIndex > 0xFFFF) {
+                std::println(stderr, "[debugger] unable to patch breakpoint at {}:{}", PyString_AsString(code->co_filename), range.line);
+                continue;
+            }
+
+            if (extraConsts.empty()) {
+                Py_INCREF(hook);
+                extraConsts.emplace_back(hook);
+            }
+
+            extraConsts.emplace_back(PyInt_FromLong(static_cast<long>(range.line)));
+
+            emit(bytes, LOAD_CONST, hookIndex);
+            emit(bytes, LOAD_CONST, lineIndex);
+            emit(bytes, CALL_FUNCTION, 1);
+            bytes += static_cast<char>(POP_TOP);
+            bytes.append(reinterpret_cast<const char*>(original) + start, end - start);
+            emit(bytes, JUMP_ABSOLUTE, end);
+
+            // the bytes between the trampoline and end are never executed
+            bytes[start] = static_cast<char>(JUMP_ABSOLUTE);
+            bytes[start + 1] = static_cast<char>(stub & 0xFF);
+            bytes[start + 2] = static_cast<char>((stub >> 8) & 0xFF);
+            patchedUntil = end;
+        }
+    }
+
+    if (extraConsts.empty() && consts == code->co_consts) {
+        return nullptr;
+    }
+
+    PyNewRef newConsts = PyTuple_New(constsBase + static_cast<int>(extraConsts.size()));
+    for (int i = 0; i < constsBase; i++) {
+        auto item = PyTuple_GET_ITEM(consts, i);
+        Py_INCREF(item);
+        PyTuple_SET_ITEM(static_cast<PyObject*>(newConsts), i, item);
+    }
+
+    for (std::size_t i = 0; i < extraConsts.size(); i++) {
+        PyObject* item = extraConsts[i];
+        Py_INCREF(item);
+        PyTuple_SET_ITEM(static_cast<PyObject*>(newConsts), constsBase + static_cast<int>(i), item);
+    }
+
+    // Note: exceptions raised by the displaced instructions report the last line of the code object,
+    // co_lnotab can't map the stubs back to their lines (line increments are unsigned)
+    PyNewRef codeString = PyString_FromStringAndSize(bytes.data(), static_cast<int>(bytes.size()));
+    auto patched = PyCode_New(
+        code->co_argcount, code->co_nlocals, code->co_stacksize + 2, code->co_flags,
+        codeString, newConsts, code->co_names, code->co_varnames, code->co_freevars, code->co_cellvars,
+        code->co_filename, code->co_name, code->co_firstlineno, code->co_lnotab
+    );
+
+    if (!patched) {
+        std::println(stderr, "[debugger] failed to create patched code object: {}", py_utils::fetch_error());
+    }
+
+    return reinterpret_cast<PyObject*>(patched);
+}
@@ -0,0 +1,54 @@
+#pragma once
+#ifndef _BF2PY_CODE_PATCHER_H_
+#define _BF2PY_CODE_PATCHER_H_
+
+#include "line_table.h"
+#include "python.h"
+#include <cstddef>
+#include <functional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace bf2py {
+	// implements breakpoints without a trace function:
+	// the func_code of affected functions is replaced by a copy which calls a hook at the start of every breakpoint line
+	//   <line start>: JUMP_ABSOLUTE stub          stub: LOAD_CONST hook; LOAD_CONST line; CALL_FUNCTION 1; POP_TOP
+	//                 (displaced instructions)          <displaced instructions>; JUMP_ABSOLUTE <after displaced>
+	// co_lnotab stays untouched, so line numbers (and tracing while stepping) keep working on the patched code
+	class code_patcher {
+	public:
+		// the lines of a code object which need a hook call (nullptr = none)
+		using lines_fn = std::function<const line_bitset* (PyCodeObject*)>;
+
+	private:
+		struct patched_code {
+			PyNewRef original;
+			PyNewRef patched; // nullptr if the code object (and its nested code objects) didn't need a patch
+		};
+
+		std::unordered_map<PyCodeObject*, patched_code> _patched;
+		std::vector<std::pair<PyNewRef, PyNewRef>> _functions; // (function, original func_code)
+		// patched code object -> original, kept across apply(): functions created from a patched co_consts (nested defs, lambdas)
+		// still use the patched code after restore() and must not be patched a second time
+		std::unordered_map<PyCodeObject*, patched_code> _originals;
+
+	public:
+		~code_patcher();
+
+		// replaces func_code of all functions (found via gc.get_objects) which contain breakpoint lines
+		// returns the number of patched functions
+		std::size_t apply(PyObject* hook, const lines_fn& lines);
+
+		// restores the original func_code of all patched functions
+		// Note: frames which are already executing a patched code object keep calling the hook,
+		// functions created from patched code objects are only restored by the next apply()
+		void restore();
+
+	private:
+		PyObject* patch(PyCodeObject* code, PyObject* hook, const lines_fn& lines);
+		PyObject* build(PyCodeObject* code, PyObject* hook, const line_bitset* lines, PyObject* consts);
+	};
+}
+
+#endif
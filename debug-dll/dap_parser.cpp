@@ -0,0 +1,150 @@
+#include "dap_parser.h"
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cstring>
+#include <format>
+#include <optional>
+using namespace bf2py;
+
+namespace {
+    constexpr std::string_view header_end = "\r\n\r\n";
+    constexpr std::string_view content_length = "Content-Length";
+
+    // a header without terminator beyond this is treated as a corrupted stream
+    constexpr std::size_t max_header = 4 * 1024;
+
+    bool equals_ignore_case(std::string_view lhs, std::string_view rhs)
+    {
+        return std::ranges::equal(lhs, rhs, [](char a, char b) {
+            return std::tolower(static_cast<unsigned char>(a)) == std::tolower(static_cast<unsigned char>(b));
+        });
+    }
+
+    std::string_view trim(std::string_view str)
+    {
+        const auto begin = str.find_first_not_of(" \t");
+        if (begin == std::string_view::npos) {
+            return {};
+        }
+
+        return str.substr(begin, str.find_last_not_of(" \t") - begin + 1);
+    }
+
+    // "Name: value\r\nName: value", unknown fields (e.g. Content-Type) are ignored
+    std::expected<std::size_t, std::string> parse_content_length(std::string_view header)
+    {
+        std::optional<std::size_t> length;
+        while (!header.empty()) {
+            const auto lineEnd = header.find("\r\n");
+            const auto line = header.substr(0, lineEnd);
+            header = lineEnd == std::string_view::npos ? std::string_view{} : header.substr(lineEnd + 2);
+
+            const auto colon = line.find(':');
+            if (colon == std::string_view::npos) {
+                return std::unexpected(std::format("malformed header field '{}'", line));
+            }
+
+            if (!equals_ignore_case(trim(line.substr(0, colon)), content_length)) {
+                continue;
+            }
+
+            const auto value = trim(line.substr(colon + 1));
+            std::size_t parsed = 0;
+            const auto [end, error] = std::from_chars(value.data(), value.data() + value.size(), parsed);
+            if (error != std::errc{} || end != value.data() + value.size() || value.empty()) {
+                return std::unexpected(std::format("invalid Content-Length '{}'", value));
+            }
+
+            length = parsed;
+        }
+
+        if (!length) {
+            return std::unexpected(std::string{ "missing Content-Length" });
+        }
+
+        if (*length == 0 || *length > dap_parser::max_body) {
+            return std::unexpected(std::format("unsupported Content-Length {}", *length));
+        }
+
+        return *length;
+    }
+}
+
+std::span<char> dap_parser::prepare(std::size_t minSize)
+{
+    if (_begin == _end) {
+        // everything is parsed, start over at the front
+        _begin = _end = _scanned = 0;
+    }
+    else if (_buffer.size() - _end < minSize && _begin > 0) {
+        // only the partially received message is moved
+        std::memmove(_buffer.data(), _buffer.data() + _begin, _end - _begin);
+        _end -= _begin;
+        _scanned -= std::min(_scanned, _begin);
+        _body -= _body ? _begin : 0;
+        _begin = 0;
+    }
+
+    // once the length is known, the whole body fits without further compaction
+    const auto required = std::max(_end + minSize, _body ? _body + _body_length : 0);
+    if (_buffer.size() < required) {
+        _buffer.resize(std::max(required, _buffer.size() * 2));
+    }
+
+    return { _buffer.data() + _end, _buffer.size() - _end };
+}
+
+std::expected<std::optional<std::string_view>, std::string> dap_parser::next()
+{
+    const auto data = _buffer.data();
+    if (!_body) {
+        // memchr is vectorized by the CRT, the candidates are only verified at a '\r'
+        auto pos = std::max(_scanned, _begin);
+        while (true) {
+            const auto found = static_cast<const char*>(pos < _end ? std::memchr(data + pos, '\r', _end - pos) : nullptr);
+            if (!found) {
+                _scanned = _end;
+                break;
+            }
+
+            pos = static_cast<std::size_t>(found - data);
+            if (_end - pos < header_end.size()) {
+                // might be the start of the terminator, checked again with the next data
+                _scanned = pos;
+                break;
+            }
+
+            if (std::string_view{ found, header_end.size() } == header_end) {
+                auto length = parse_content_length({ data + _begin, pos - _begin });
+                if (!length) {
+                    return std::unexpected(length.error());
+                }
+
+                _body = pos + header_end.size();
+                _body_length = *length;
+                break;
+            }
+
+            pos++;
+        }
+
+        if (!_body) {
+            if (_end - _begin > max_header) {
+                return std::unexpected(std::format("no header terminator within {} bytes", max_header));
+            }
+
+            return std::nullopt;
+        }
+    }
+
+    if (_end - _body < _body_length) {
+        return std::nullopt;
+    }
+
+    const auto body = std::string_view{ data + _body, _body_length };
+    _begin = _scanned = _body + _body_length;
+    _body = 0;
+    _body_length = 0;
+    return body;
+}
@@ -0,0 +1,46 @@
+#pragma once
+#ifndef _BF2PY_DAP_PARSER_H_
+#define _BF2PY_DAP_PARSER_H_
+
+#include <cstddef>
+#include <expected>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace bf2py {
+	// splits the DAP byte stream ("Content-Length: n\r\n\r\n" + n bytes of json) into message bodies,
+	// incrementally and without copying: the socket reads directly into prepare(), next() returns views into the same buffer
+	// Note: doesn't depend on asio or python, so it can be benchmarked and fuzzed by debug-test
+	class dap_parser {
+	public:
+		// a body larger than this is treated as a corrupted stream
+		static constexpr std::size_t max_body = 64 * 1024 * 1024;
+
+	private:
+		std::vector<char> _buffer;
+		std::size_t _begin = 0; // start of the first unparsed message
+		std::size_t _end = 0; // end of the received data
+		std::size_t _scanned = 0; // the header terminator isn't in [_begin, _scanned)
+		std::size_t _body = 0; // > 0: the header is parsed, the body starts at _begin
+		std::size_t _body_length = 0;
+
+	public:
+		explicit dap_parser(std::size_t capacity = 64 * 1024) : _buffer(capacity) {}
+
+		// free space for the next read (at least minSize bytes), invalidates the views returned by next
+		std::span<char> prepare(std::size_t minSize = 4 * 1024);
+		// n bytes were written to the space returned by prepare
+		void commit(std::size_t n) { _end += n; }
+
+		// the body of the next complete message (valid until the next prepare),
+		// std::nullopt if more data is needed, an error if the stream is corrupted (the session should be closed)
+		std::expected<std::optional<std::string_view>, std::string> next();
+
+		std::size_t buffered() const { return _end - _begin; }
+	};
+}
+
+#endif
@@ -0,0 +1,71 @@
+#pragma once
+#include "python.h"
+#include <cstddef>
+#include <string>
+
+// a watched variable: an entry of a dict (e.g. module globals) or a fast local of one frame
+// changes are detected by comparing a fingerprint of the value, never its repr
+struct DataBreakpoint
+{
+    struct fingerprint {
+        PyObject* identity = nullptr;
+        PyTypeObject* type = nullptr;
+        long value = 0; // int value, cached str hash or the size of a list/dict (in-place modifications)
+
+        bool operator==(const fingerprint&) const = default;
+
+        static fingerprint of(PyObject* value)
+        {
+            if (!value) {
+                return {};
+            }
+
+            auto result = fingerprint{ .identity = value, .type = Py_TYPE(value) };
+            if (PyInt_CheckExact(value)) {
+                result.value = PyInt_AS_LONG(value);
+            }
+            else if (PyString_CheckExact(value)) {
+                result.value = reinterpret_cast<PyStringObject*>(value)->ob_shash;
+            }
+            else if (PyDict_Check(value)) {
+                result.value = reinterpret_cast<PyDictObject*>(value)->ma_used;
+            }
+            else if (PyList_Check(value)) {
+                result.value = static_cast<long>(PyList_GET_SIZE(value));
+            }
+
+            return result;
+        }
+    };
+
+    const std::string name;
+    bf2py::PyNewRef container; // the dict or the frame
+    bf2py::PyNewRef key; // dict entries only
+    const int local = -1; // index into f_localsplus (frame locals only)
+
+    fingerprint last;
+    std::size_t hits = 0;
+
+    // container and key are borrowed references
+    DataBreakpoint(const std::string& name, PyObject* container, PyObject* key, int local = -1)
+        : name(name), local(local)
+    {
+        Py_XINCREF(container);
+        this->container = container;
+        Py_XINCREF(key);
+        this->key = key;
+        last = fingerprint::of(value());
+    }
+
+    bool is_local() const { return local >= 0; }
+
+    // borrowed, nullptr if the entry doesn't exist (or the local is unbound)
+    PyObject* value()
+    {
+        if (is_local()) {
+            return reinterpret_cast<PyFrameObject*>(static_cast<PyObject*>(container))->f_localsplus[local];
+        }
+
+        return PyDict_GetItem(container, key);
+    }
+};
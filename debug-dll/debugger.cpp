@@ -1,34 +1,242 @@
 #include "debugger.h"
+#include "bdb_trace.h"
+#include <chrono>
+#include <format>
 #include <print>
 using namespace bf2py;
 
-int debugger::trace_dispatch(PyFrameObject* frame, int event, PyObject* arg)
+namespace {
+    // the snapshot must stay small even for huge dicts (e.g. the globals of bf2)
+    constexpr std::size_t snapshot_depth = 2;
+    constexpr std::size_t snapshot_items = 100; // per container
+    constexpr std::size_t snapshot_variables = 10'000; // in total
+    constexpr std::size_t snapshot_repr = 256;
+    constexpr std::size_t snapshot_limit = 100; // files per run, an exception in every tick must not fill the disk
+
+    class snapshot_capture {
+        std::size_t _budget = snapshot_variables;
+
+    public:
+        snapshot::variable capture(std::string name, PyObject* value, std::size_t depth)
+        {
+            --_budget;
+            auto variable = snapshot::variable{ .name = std::move(name), .type = value->ob_type->tp_name, .value = repr(value) };
+            if (depth == 0) {
+                return variable;
+            }
+
+            // modules, classes and functions are only shown, their attributes would just repeat the globals
+            PyObject* dict = nullptr;
+            if (PyDict_Check(value)) {
+                dict = value;
+            }
+            else if (PyInstance_Check(value)) {
+                dict = reinterpret_cast<PyInstanceObject*>(value)->in_dict;
+            }
+            else if (!PyModule_Check(value) && !PyType_Check(value) && !PyClass_Check(value) && !PyFunction_Check(value)) {
+                auto dictPtr = _PyObject_GetDictPtr(value);
+                dict = dictPtr ? *dictPtr : nullptr;
+            }
+
+            if (dict) {
+                variable.children = capture_dict(dict, depth - 1);
+            }
+            else if (PyList_Check(value) || PyTuple_Check(value)) {
+                const auto size = PySequence_Size(value);
+                for (decltype(PySequence_Size(value)) i = 0; i < size && variable.children.size() < snapshot_items && _budget > 0; i++) {
+                    auto item = PyList_Check(value) ? PyList_GET_ITEM(value, i) : PyTuple_GET_ITEM(value, i);
+                    variable.children.push_back(capture(std::format("[{}]", i), item, depth - 1));
+                }
+            }
+
+            return variable;
+        }
+
+        std::vector<snapshot::variable> capture_dict(PyObject* dict, std::size_t depth)
+        {
+            std::vector<snapshot::variable> variables;
+            PyObject* key, * value;
+            int pos = 0;
+            while (PyDict_Next(dict, &pos, &key, &value) && variables.size() < snapshot_items && _budget > 0) {
+                variables.push_back(capture(PyString_Check(key) ? PyString_AS_STRING(key) : repr(key), value, depth));
+            }
+
+            return variables;
+        }
+
+    private:
+        static std::string repr(PyObject* obj)
+        {
+            PyNewRef str = PyObject_Repr(obj);
+            if (!str) {
+                PyErr_Clear();
+                return std::format("<{} object>", obj->ob_type->tp_name);
+            }
+
+            auto text = std::string{ PyString_AS_STRING(static_cast<PyObject*>(str)), static_cast<std::size_t>(PyString_GET_SIZE(static_cast<PyObject*>(str))) };
+            if (text.size() > snapshot_repr) {
+                text.resize(snapshot_repr);
+                text += "...";
+            }
+
+            return text;
+        }
+    };
+}
+
+debugger::debugger()
 {
-    if (trace_ignore()) {
+    use_host<debugger>();
+}
+
+void debugger::static_dispatch(bool enable)
+{
+    if (enable) {
+        use_host<debugger>();
+    }
+    else {
+        use_host<bdb>();
+    }
+}
+
+int debugger::trace_dispatch(thread_state& ts, PyFrameObject* frame, int event, PyObject* arg)
+{
+    if (_trace_mode == trace_mode::PYTHON_THREAD || trace_ignore(ts)) {
         // when evaluating (e.g. a breakpoint condition) or quitting, there is no need for any additional overhead
-        return bdb::trace_dispatch(frame, event, arg);
+        // in PYTHON_THREAD mode all state changes from the session are applied via post_to_python,
+        // so the stop/break checks can run inline and _ctx is only used when we actually stop
+        return dispatch<debugger>(ts, frame, event, arg);
     }
 
     return asio::post(_ctx, asio::use_future([&] {
-        return bdb::trace_dispatch(frame, event, arg);
+        return dispatch<debugger>(ts, frame, event, arg);
     })).get();
 }
 
+bdb::trace_kind debugger::select_trace(const thread_state& ts) const
+{
+    // the specialized trace functions run inline, IO_THREAD needs the virtual trace_dispatch
+    if (_trace_mode == trace_mode::IO_THREAD) {
+        return trace_kind::DISPATCH;
+    }
+
+    return bdb::select_trace(ts);
+}
+
+void debugger::post_to_python(std::move_only_function<void()> fn)
+{
+    {
+        std::lock_guard lock{ _python_calls_mutex };
+        _python_calls.push_back(std::move(fn));
+
+        if (!_python_calls_scheduled) {
+            // the python thread is either running bytecode (-> pending call)
+            // or waiting in one of our own loops (-> process_events), whichever comes first drains the queue
+            schedule_python_calls();
+        }
+    }
+
+    _python_calls_posted.notify_one();
+}
+
+void debugger::schedule_python_calls()
+{
+    _python_calls_scheduled = Py_AddPendingCall([](void* self) -> int {
+        static_cast<debugger*>(self)->run_python_calls();
+        return 0;
+    }, this) == 0;
+}
+
+void debugger::run_python_calls()
+{
+    // pending calls also run while a trace callback evaluates python code (a breakpoint condition or logpoint),
+    // e.g. set_breaks or detach would then free the breakpoints break_here is iterating: wait until no callback is in progress
+    decltype(_python_calls) calls;
+    {
+        std::lock_guard lock{ _python_calls_mutex };
+        _python_calls_scheduled = false;
+        if (_callbacks > 0) {
+            _python_calls_deferred = !_python_calls.empty();
+            _notify_idle = _notify_idle || _python_calls_deferred;
+            return;
+        }
+
+        calls.swap(_python_calls);
+        _python_calls_deferred = false;
+    }
+
+    // python code run by a call (e.g. evaluate) must not drain the queue recursively
+    callback_scope scope{ *this };
+    for (auto& call : calls) {
+        call();
+    }
+}
+
+void debugger::user_idle()
+{
+    {
+        std::lock_guard lock{ _python_calls_mutex };
+        _python_calls_deferred = false;
+        if (!_python_calls.empty() && !_python_calls_scheduled) {
+            schedule_python_calls();
+        }
+    }
+
+    _python_calls_posted.notify_one();
+}
+
+void debugger::process_events()
+{
+    // the callback waiting here is at a safe point, the calls can run unless another one is in progress
+    _callbacks--;
+
+    // a short timeout, so that the conditions of run_until which aren't set by a python call are checked regularly
+    if (_trace_mode == trace_mode::PYTHON_THREAD) {
+        // only the io thread runs _ctx, so no handler (session, output timer, profiler) ever runs on two threads at once:
+        // this thread just waits for the calls the session posts,
+        // the other python threads keep running while this one waits (e.g. stopped on a breakpoint)
+        Py_BEGIN_ALLOW_THREADS
+        {
+            std::unique_lock lock{ _python_calls_mutex };
+            _python_calls_posted.wait_for(lock, std::chrono::milliseconds(10), [&] { return !_python_calls.empty() && !_python_calls_deferred; });
+        }
+        Py_END_ALLOW_THREADS
+    }
+    else {
+        // IO_THREAD: the io thread runs this loop, on behalf of the python thread (which holds the GIL)
+        _ctx.run_one_for(std::chrono::milliseconds(10));
+    }
+
+    run_python_calls();
+    _callbacks++;
+}
+
+std::shared_ptr<debugger_session> debugger::session() const
+{
+    std::lock_guard lock{ _session_mutex };
+    return _session;
+}
+
 void debugger::setHostModule(const decltype(_hostModule)& hostModule)
 {
     _hostModule = hostModule;
 
-    if (_session) {
+    const auto session = this->session();
+    if (session) {
         auto it = _hostModule.find("sgl_getModDirectory");
         if (it != _hostModule.end()) {
             auto modDir = it->second(nullptr, nullptr);
-            _session->send_modpath(std::format("{};{}", std::filesystem::current_path().string(), PyString_AS_STRING(modDir)));
+            session->send_modpath(std::format("{};{}", std::filesystem::current_path().string(), PyString_AS_STRING(modDir)));
         }
     }
 }
 
 void debugger::start()
 {
+    // samples taken while we are stopped would only show the debugger's own wait loop,
+    // and in IO_THREAD mode the io thread runs it while the waiting python thread holds the GIL
+    _profiler.paused([this] { return _state == Status::Stopped || _waiting > 0; });
+
     asio::co_spawn(_ctx, run(), asio::detached);
     start_io_runner();
 }
@@ -46,9 +254,31 @@ asio::awaitable<void> debugger::run()
         if (error)
             break;
 
-        // only one session at a time
-        _session.emplace(*this, std::move(socket));
-        co_await _session->run();
+        // only one session at a time, the python thread keeps its own reference while it uses it
+        auto session = std::make_shared<debugger_session>(*this, std::move(socket), _write_limit, _output_policy);
+        {
+            std::lock_guard lock{ _session_mutex };
+            _session = session;
+        }
+
+        co_await session->run();
+
+        // a disconnected client must not leave the server traced (or stopped),
+        // the next client is only accepted once the python thread is done with this one
+        co_await async_call([&] {
+            {
+                std::lock_guard lock{ _session_mutex };
+                _session.reset();
+            }
+
+            // the last reference might be dropped on the io thread
+            session->release();
+            detach();
+            _data_targets.clear();
+            for (auto& [threadId, stop] : _stops) {
+                stop.resumed = true;
+            }
+        });
     }
 }
 
@@ -63,44 +293,61 @@ void debugger::start_io_runner()
 
 void debugger::user_entry(PyFrameObject* frame)
 {
-    if (_wait_for_connection) {
+    if (_entry_pending) {
         std::println("[debugger] waiting for session to connect on port {} ...", _port);
 
-        while (!_session || !_session->initialized()) {
-			_ctx.run_one();
-        }
+        auto session = this->session();
+        run_until([&] {
+            session = this->session();
+            return session && session->initialized();
+        });
 
-        _wait_for_connection = false;
-        _session->send_entry(frame->f_tstate->thread_id);
+        // interaction removes the trace function if it is no longer needed
+        _entry_pending = false;
+        session->send_entry(frame->f_tstate->thread_id);
         interaction(frame, nullptr);
     }
 }
 
 void debugger::user_call(PyFrameObject* frame)
 {
-    if (!_session) {
+    const auto session = this->session();
+    if (!session) {
         return;
     }
     
-    if (stop_here(frame)) {
-		_session->send_step(frame->f_tstate->thread_id);
+    auto& ts = thread(frame->f_tstate->thread_id);
+    if (ts.function_hit) {
+        session->send_function_breakpoint(frame->f_tstate->thread_id, ts.function_hit->name);
+        interaction(frame, nullptr);
+    }
+    else if (stop_here(ts, frame)) {
+		session->send_step(frame->f_tstate->thread_id);
         interaction(frame, nullptr);
     }
 }
 
 void debugger::user_line(PyFrameObject* frame)
 {
-    if (!_session) {
+    const auto session = this->session();
+    if (!session) {
         return;
     }
 
-    _session->send_step(frame->f_tstate->thread_id);
+    if (auto dataHit = thread(frame->f_tstate->thread_id).data_hit) {
+        session->send_data_breakpoint(frame->f_tstate->thread_id, std::format("'{}' changed", dataHit->name));
+    }
+    else {
+        session->send_step(frame->f_tstate->thread_id);
+    }
+
     interaction(frame, nullptr);
 }
 
 void debugger::user_return(PyFrameObject* frame, PyObject* returnValue)
 {
-    if (!_session) {
+    const auto session = this->session();
+    if (!session) {
         return;
     }
 
@@ -108,18 +355,29 @@ void debugger::user_return(PyFrameObject* frame, PyObject* returnValue)
         PyDict_SetItemString(frame->f_locals, "__return__", returnValue);
     }
 
-    _session->send_step(frame->f_tstate->thread_id);
+    session->send_step(frame->f_tstate->thread_id);
     interaction(frame, nullptr);
 }
 
 void debugger::user_exception(PyFrameObject* frame, PyObject* excInfo)
 {
+    const auto session = this->session();
     auto type = PyTuple_GET_ITEM(excInfo, 0);
     auto value = PyTuple_GET_ITEM(excInfo, 1);
     auto traceback = PyTuple_GET_ITEM(excInfo, 2);
     PyNewRef valueRepr = PyObject_Repr(value);
     PyNewRef typeStr = PyObject_Str(type);
 
+    if (!_attached || !session) {
+        // nobody can look at it now (no client, or one which hasn't finished its configuration), keep it for later
+        if (!_snapshot_dir.empty() && valueRepr && typeStr) {
+            write_snapshot(frame, traceback, std::format("{}: {}", PyString_AsString(typeStr), PyString_AsString(valueRepr)));
+        }
+
+        PyErr_Clear();
+        return;
+    }
+
     if (!frame->f_locals) {
         PyFrame_FastToLocals(frame);
     }
@@ -135,47 +393,192 @@ void debugger::user_exception(PyFrameObject* frame, PyObject* excInfo)
     }
 
     if (valueRepr && typeStr) {
-        _session->send_exception(frame->f_tstate->thread_id, std::format("{}: {}", PyString_AsString(typeStr), PyString_AsString(valueRepr)));
+        session->send_exception(frame->f_tstate->thread_id, std::format("{}: {}", PyString_AsString(typeStr), PyString_AsString(valueRepr)));
     }
 
     interaction(frame, traceback);
 }
 
+void debugger::snapshot_dir(const std::filesystem::path& dir)
+{
+    _snapshot_dir = dir;
+    set_postmortem(!dir.empty());
+}
+
+void debugger::write_snapshot(PyFrameObject* frame, PyObject* traceback, const std::string& exception)
+{
+    if (_snapshots >= snapshot_limit) {
+        return;
+    }
+
+    const auto now = std::chrono::floor<std::chrono::seconds>(std::chrono::system_clock::now());
+    auto result = snapshot{
+        .thread = static_cast<std::uint32_t>(frame->f_tstate->thread_id),
+        .time = now.time_since_epoch().count(),
+        .exception = exception
+    };
+
+    // the reprs might run python code
+    auto& ts = thread(frame->f_tstate->thread_id);
+    ts.evaling = true;
+    auto capture = snapshot_capture{};
+    auto globals = std::unordered_map<PyObject*, std::uint32_t>{};
+    const auto [stack, index] = get_stack(frame, traceback);
+    for (auto it = stack.rbegin(); it != stack.rend(); ++it) {
+        const auto [stackFrame, line] = *it;
+        if (!stackFrame->f_locals) {
+            PyFrame_FastToLocals(stackFrame);
+        }
+
+        auto& entry = result.frames.emplace_back(snapshot::frame{
+            .filename = canonic(PyString_AsString(stackFrame->f_code->co_filename)),
+            .function = PyString_AsString(stackFrame->f_code->co_name),
+            .line = static_cast<std::uint32_t>(line)
+        });
+
+        // module level code has the globals as locals
+        if (stackFrame->f_locals && stackFrame->f_locals != stackFrame->f_globals) {
+            entry.locals = capture.capture_dict(stackFrame->f_locals, snapshot_depth);
+        }
+
+        auto [globalsIt, added] = globals.emplace(stackFrame->f_globals, static_cast<std::uint32_t>(result.globals.size()));
+        if (added) {
+            result.globals.push_back(capture.capture_dict(stackFrame->f_globals, snapshot_depth));
+        }
+
+        entry.globals = globalsIt->second;
+    }
+    ts.evaling = false;
+
+    std::error_code ec;
+    std::filesystem::create_directories(_snapshot_dir, ec);
+    const auto path = _snapshot_dir / std::format("bf2py-snapshot-{:%Y%m%d-%H%M%S}-{}.bin", now, _snapshots++);
+    if (result.write(path)) {
+        std::println(stderr, "[debugger] {}, wrote a snapshot to {}", exception, path.string());
+    }
+}
+
 void debugger::on_breakpoint_error(Breakpoint& bp, const std::string& message)
 {
     log(std::format("breakpoint eval error: {}\n", message));
 }
 
+void debugger::user_log(Breakpoint& bp, const std::string& message)
+{
+    log(message);
+}
+
+void debugger::append_output(std::string_view text)
+{
+    const auto session = this->session();
+    if (!session) {
+        return;
+    }
+
+    switch (_output.append(text)) {
+    case output_batcher::flush_t::LATER:
+        // everything logged until the timer expires goes out in the same event
+        asio::post(_output_strand, [this] { schedule_output(); });
+        break;
+    case output_batcher::flush_t::NOW:
+        asio::post(_output_strand, [this] { flush_output(); });
+        break;
+    default:
+        break;
+    }
+}
+
+void debugger::schedule_output()
+{
+    _output_timer.expires_after(_output_interval);
+    _output_timer.async_wait(asio::bind_executor(_output_strand, [this](const std::error_code& error) {
+        if (!error) {
+            flush_output();
+        }
+    }));
+}
+
+void debugger::flush_output()
+{
+    // the batcher keeps the previous buffer, so neither side allocates once the buffers have grown
+    _output_buffer.clear();
+    const auto again = _output.take(_output_buffer);
+    const auto session = this->session();
+    if (session && !_output_buffer.empty()) {
+        session->send_output(_output_buffer);
+    }
+
+    if (again) {
+        schedule_output();
+    }
+}
+
 void debugger::interaction(PyFrameObject* frame, PyObject* traceback)
 {
-    setup(frame, traceback);
+    const auto threadId = frame->f_tstate->thread_id;
+    auto& stop = setup(frame, traceback);
     _state = Status::Stopped;
-    
-    while (_state == Status::Stopped) {
-        _ctx.run_one();
-    }
 
-    forget();
+    // other threads handle their trace events while we wait (their state is kept in their own thread_state)
+    run_until([&] { return stop.resumed; });
+
+    forget(threadId);
+
+    // e.g. the CODE_PATCH engine only traces while stepping
+    update_trace();
 }
 
-void debugger::setup(PyFrameObject* frame, PyObject* traceback)
+debugger::stop_t& debugger::setup(PyFrameObject* frame, PyObject* traceback)
 {
-    forget();
-    std::tie(_stack, _curindex) = get_stack(frame, traceback);
-    _curframe = _stack[_curindex].first;
-    _curthread = frame->f_tstate->thread_id;
+    const auto threadId = frame->f_tstate->thread_id;
+    forget(threadId);
+
+    auto& stop = _stops[threadId];
+    std::tie(stop.stack, stop.curindex) = get_stack(frame, traceback);
+    stop.curframe = stop.stack[stop.curindex].first;
+    return stop;
 }
 
-void debugger::forget()
+void debugger::forget(thread_id_t threadId)
 {
-	if (_session) {
-		_session->forget(_curthread);
+    const auto session = this->session();
+	if (session) {
+		session->forget(threadId);
 	}
 
-    _stack.clear();
-    _curindex = 0;
-    _curframe = nullptr;
-    _curthread = -1;
+    _stops.erase(threadId);
+    if (_stops.empty()) {
+        _state = Status::Running;
+    }
+}
+
+PyFrameObject* debugger::stopped_frame(thread_id_t threadId) const
+{
+    auto it = _stops.find(threadId);
+    return it != _stops.end() ? it->second.curframe : nullptr;
+}
+
+PyFrameObject* debugger::stopped_frame() const
+{
+    return _stops.empty() ? nullptr : _stops.begin()->second.curframe;
+}
+
+void debugger::resume(thread_id_t threadId)
+{
+    auto it = _stops.find(threadId);
+    if (it != _stops.end()) {
+        it->second.resumed = true;
+    }
+}
+
+void debugger::resume_others(thread_id_t threadId)
+{
+    for (auto& [id, stop] : _stops) {
+        if (id != threadId) {
+            set_continue(thread(id));
+            stop.resumed = true;
+        }
+    }
 }
 
 void debugger::do_clear(Breakpoint& bp)
@@ -185,14 +588,10 @@ void debugger::do_clear(Breakpoint& bp)
 
 void debugger::log(const std::string& msg)
 {
-    if (_session) {
-        _session->send_output(msg);
-    }
+    append_output(msg);
 }
 
 void debugger::log(const std::u8string& msg)
 {
-    if (_session) {
-        _session->send_output(msg);
-    }
+    append_output({ reinterpret_cast<const char*>(msg.data()), msg.size() });
 }
\ No newline at end of file
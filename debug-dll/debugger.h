@@ -2,14 +2,32 @@
 #include "asio.h"
 #include "bdb.h"
 #include "debugger_session.h"
+#include "function_profiler.h"
+#include "output_batcher.h"
+#include "sampling_profiler.h"
+#include "snapshot.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstddef>
+#include <functional>
 #include <map>
+#include <memory>
 #include <deque>
+#include <filesystem>
+#include <mutex>
 #include <optional>
+#include <string_view>
 #include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
 
 namespace bf2py {
-	class debugger : public bdb {
+	// final: the per-event path of bdb calls the hooks below directly (see bdb::use_host)
+	class debugger final : public bdb {
+		friend class bdb;
+
 	public:
 		enum class Status {
 			Running,
@@ -18,24 +36,68 @@ namespace bf2py {
 
 		using thread_id_t = decltype(PyThreadState::thread_id);
 
+		// where bdb::trace_dispatch runs: IO_THREAD marshals every event through _ctx (the old behavior),
+		// PYTHON_THREAD runs it inline and only involves _ctx when we stop or need to send something
+		enum class trace_mode : unsigned char {
+			IO_THREAD,
+			PYTHON_THREAD
+		};
+
 	private:
 		asio::io_context _ctx;
 		asio::ip::port_type _port = 5678;
-		bool _wait_for_connection = true;
 		std::jthread _io_runner;
+		sampling_profiler _profiler{ _ctx };
+		function_profiler _call_profiler;
+		trace_mode _trace_mode = trace_mode::PYTHON_THREAD;
+
+		// work which must run on the python thread (e.g. modifying breakpoints while the interpreter is running)
+		std::mutex _python_calls_mutex;
+		std::vector<std::move_only_function<void()>> _python_calls;
+		std::condition_variable _python_calls_posted; // wakes up process_events
+		bool _python_calls_scheduled = false;
+		bool _python_calls_deferred = false; // a trace callback was in progress, they run once it returns (see user_idle)
+
+		// replaced by the io thread for every client (only after the python thread released the previous one),
+		// used by all threads, which keep their own reference while they use it (see session())
+		mutable std::mutex _session_mutex;
+		std::shared_ptr<debugger_session> _session;
+		std::size_t _write_limit = 1024 * 1024;
+		debugger_session::output_policy _output_policy = debugger_session::output_policy::MERGE;
+
+		// all output (stdout/stderr, host.log, logpoints) of any thread, sent in batches by the io thread
+		output_batcher _output;
+		std::chrono::milliseconds _output_interval{ 10 };
+		// the flushes and the timer only run on this strand, whichever thread runs _ctx
+		asio::strand<asio::io_context::executor_type> _output_strand{ asio::make_strand(_ctx) };
+		asio::steady_timer _output_timer{ _output_strand };
+		std::string _output_buffer; // _output_strand only, reused by every flush
+
+		// Stopped while any thread is stopped, written by the python thread and read by the io thread (e.g. the profiler)
+		std::atomic<Status> _state = Status::Running;
+		std::atomic<std::size_t> _waiting = 0; // threads in run_until (e.g. user_entry waiting for a client)
+
+		// every thread stops on its own, the others keep running (python thread only)
+		struct stop_t {
+			std::deque<std::pair<PyFrameObject*, std::size_t>> stack;
+			std::size_t curindex = 0;
+			PyFrameObject* curframe = nullptr;
+			bool resumed = false;
+		};
+		std::unordered_map<thread_id_t, stop_t> _stops;
 
-		std::optional<debugger_session> _session;
+		std::map<std::string, PyCFunction> _hostModule;
 
-		Status _state = Status::Running;
+		// variables offered via dataBreakpointInfo (by dataId), python thread only
+		std::unordered_map<std::string, DataBreakpoint> _data_targets;
 
-		std::deque<std::pair<PyFrameObject*, std::size_t>> _stack;
-		std::size_t _curindex = 0;
-		PyFrameObject* _curframe = nullptr;
-		thread_id_t _curthread = -1;
-
-		std::map<std::string, PyCFunction> _hostModule;
+		// unhandled exceptions without a client are written to this directory (empty = off)
+		std::filesystem::path _snapshot_dir;
+		std::size_t _snapshots = 0;
 
 	public:
+		debugger();
+
 		void setHostModule(const decltype(_hostModule)& _hostModule);
 
 		void start();
@@ -54,25 +116,90 @@ namespace bf2py {
 			log(std::vformat(fmt, std::make_format_args(args...)));
 		}
 
-		const auto& stack() const { return _stack; }
-		auto& breaks() { return _breaks; }
-		const auto& current_frame() const { return _curframe; }
-		const auto& current_thread() const { return _curthread; }
-		
-		auto state() const { return _state; }
-		void state(decltype(_state) state) { _state = state; }
+		const auto& breaks() const { return _breaks; }
+		auto& data_targets() { return _data_targets; }
+		// the frame the thread is stopped in (nullptr if it is running), python thread only
+		PyFrameObject* stopped_frame(thread_id_t threadId) const;
+		// the frame of any stopped thread
+		PyFrameObject* stopped_frame() const;
+		bool stopped(thread_id_t threadId) const { return _stops.contains(threadId); }
+
+		Status state() const { return _state; }
+		// the session of the connected client (nullptr if there is none), any thread
+		std::shared_ptr<debugger_session> session() const;
+
+		// python thread only: lets a stopped thread run again,
+		// step (set_next/set_step/...) must be set on the thread's state beforehand
+		void resume(thread_id_t threadId);
+		// continues all stopped threads except the given one
+		void resume_others(thread_id_t threadId);
 		
-		auto wait_for_connection() const { return _wait_for_connection; }
-		void wait_for_connection(bool wait) { _wait_for_connection = wait; }
+		auto wait_for_connection() const { return _entry_pending; }
+		void wait_for_connection(bool wait) { _entry_pending = wait; }
+
+		// post-mortem snapshots of unhandled exceptions while no client is attached (see snapshot, debug-test -replay)
+		void snapshot_dir(const std::filesystem::path& dir);
 
 		auto port() const { return _port; }
 		void port(decltype(_port) port) { _port = port; }
 
+		auto& profiler() { return _profiler; }
+		// python thread only
+		auto& call_profiler() { return _call_profiler; }
+
+		auto mode() const { return _trace_mode; }
+		void mode(trace_mode mode) { _trace_mode = mode; }
+
+		// how many bytes may be queued for a slow client before output events are merged or dropped (applies to the next session)
+		void write_queue(std::size_t limit, debugger_session::output_policy policy) { _write_limit = limit; _output_policy = policy; }
+		// output is collected for interval before it is sent, lines beyond rate lines/s (0 = unlimited) are suppressed
+		void output_limit(std::chrono::milliseconds interval, double rate) { _output_interval = interval; _output.limit(rate); }
+
+		// false: the trace functions call the hooks through the vtable (bdb's generic instantiation, for comparison)
+		// must be set before the trace function is installed
+		void static_dispatch(bool enable);
+
+		// schedules fn to be executed on the python thread:
+		// either from the debugger's own wait loops or via Py_AddPendingCall while the interpreter is running
+		void post_to_python(std::move_only_function<void()> fn);
+
+		// like post_to_python, but the calling coroutine resumes (on _ctx) with the result of fn
+		template<typename Fn, typename R = std::invoke_result_t<Fn&>>
+		asio::awaitable<R> async_call(Fn fn)
+		{
+			if constexpr (std::is_void_v<R>) {
+				co_await asio::async_initiate<decltype(asio::use_awaitable), void()>(
+					[this, fn = std::move(fn)](auto handler) mutable {
+						post_to_python([this, fn = std::move(fn), handler = std::move(handler)]() mutable {
+							fn();
+							auto ex = asio::get_associated_executor(handler, _ctx.get_executor());
+							asio::post(ex, std::move(handler));
+						});
+					},
+					asio::use_awaitable
+				);
+			}
+			else {
+				co_return co_await asio::async_initiate<decltype(asio::use_awaitable), void(R)>(
+					[this, fn = std::move(fn)](auto handler) mutable {
+						post_to_python([this, fn = std::move(fn), handler = std::move(handler)]() mutable {
+							auto ex = asio::get_associated_executor(handler, _ctx.get_executor());
+							asio::post(ex, [handler = std::move(handler), result = fn()]() mutable {
+								std::move(handler)(std::move(result));
+							});
+						});
+					},
+					asio::use_awaitable
+				);
+			}
+		}
+
 	private:
 		asio::awaitable<void> run();
 		void start_io_runner();
 
-		virtual int trace_dispatch(PyFrameObject* frame, int event, PyObject* arg);
+		virtual int trace_dispatch(thread_state& ts, PyFrameObject* frame, int event, PyObject* arg) override;
+		virtual trace_kind select_trace(const thread_state& ts) const override;
 		virtual void user_entry(PyFrameObject* frame) override;
 		virtual void user_call(PyFrameObject* frame) override;
 		virtual void user_line(PyFrameObject* frame) override;
@@ -80,16 +207,30 @@ namespace bf2py {
 		virtual void user_exception(PyFrameObject* frame, PyObject* excInfo) override;
 		virtual void on_breakpoint_error(Breakpoint& bp, const std::string& message) override;
 		virtual void do_clear(Breakpoint& bp) override;
+		virtual void user_log(Breakpoint& bp, const std::string& message) override;
+		virtual void user_idle() override;
+
+		void append_output(std::string_view text);
+		void schedule_output();
+		void flush_output();
+		void write_snapshot(PyFrameObject* frame, PyObject* traceback, const std::string& exception);
+
+		// _python_calls_mutex must be held
+		void schedule_python_calls();
+		void run_python_calls();
+		void process_events();
 
 		void interaction(PyFrameObject* frame, PyObject* traceback);
-		void setup(PyFrameObject* frame, PyObject* traceback);
-		void forget();
+		stop_t& setup(PyFrameObject* frame, PyObject* traceback);
+		void forget(thread_id_t threadId);
 
 		void run_until(auto fn)
 		{
+			_waiting++;
 			while (!fn()) {
-				_ctx.run_one();
+				process_events();
 			}
+			_waiting--;
 		}
 	};
 }
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include "debugger_session.h"
+#include "dap_parser.h"
 #include "debugger.h"
 #include <string>
 #include <iostream>
@@ -6,6 +7,8 @@
 #include <ranges>
 #include <algorithm>
 #include <chrono>
+#include <iterator>
+#include <optional>
 #include <thread>
 #include <chrono>
 #include "output_redirect.h"
@@ -13,65 +16,189 @@
 using namespace bf2py;
 using namespace nlohmann;
 namespace {
-	std::hash<PyObject*> pyObjectHash{};
 	std::hash<PyFrameObject*> pyFrameObjectHash{};
 	std::hash<std::string> filenameHash{};
 }
 
-debugger_session::debugger_session(debugger& debugger, asio::ip::tcp::socket socket)
-	: _debugger(debugger), _socket(std::move(socket))
-{
+namespace {
+	std::string frame(const json& data)
+	{
+		auto dataBytes = data.dump();
+		return std::format("Content-Length: {}\r\n\r\n{}", dataBytes.size(), dataBytes);
+	}
 
-}
+	std::string output_frame(const std::string& output)
+	{
+		return frame({
+			{ "type", "event" },
+			{ "event", "output" },
+			{ "body", {
+				{ "category", "console" },
+				{ "output", output }
+			}}
+		});
+	}
 
-std::uint32_t get_packet_length(asio::streambuf& buffer)
-{
-	auto stream = std::istream{ &buffer };
-	std::string header;
-	std::uint32_t length = 0;
-	while (std::getline(stream, header)) {
-		if (header.empty() || header == "\r") {
-			break;
+	// bigger dicts are offered as indexed variables, which the client requests in pages of this size (start/count)
+	constexpr std::size_t page_size = 100;
+	// characters per value, the rest is cut off
+	constexpr std::size_t max_value = 256;
+
+	// appends str(obj) (repr(obj) for items of containers) to out, but never beyond limit characters:
+	// containers and long strings are converted item by item/only partially instead of as a whole
+	void append_value(std::string& out, PyObject* obj, bool repr, std::size_t limit)
+	{
+		const auto remaining = limit - std::min(limit, out.size());
+		if (PyString_Check(obj) && static_cast<std::size_t>(PyString_GET_SIZE(obj)) > remaining) {
+			if (!repr) {
+				out.append(PyString_AS_STRING(obj), remaining);
+				return;
+			}
+
+			PyNewRef prefix = PyString_FromStringAndSize(PyString_AS_STRING(obj), remaining);
+			append_value(out, prefix, repr, limit);
+			return;
 		}
-		if (header.starts_with("Content-Length:")) {
-			auto pos = header.find(':');
-			if (pos != std::string::npos) {
-				auto end = std::string::size_type{};
-				length = std::stoul(header.substr(pos + 1), &end);
-				if (end == header.length() - std::string_view{ "Content-Length:" }.length()) {
-					return 0;
+
+		const auto list = PyList_Check(obj), tuple = PyTuple_Check(obj), dict = PyDict_Check(obj);
+		if (list || tuple || dict) {
+			out += list ? '[' : tuple ? '(' : '{';
+			PyObject* key, * value;
+			int pos = 0;
+			for (int i = 0; dict ? PyDict_Next(obj, &pos, &key, &value) : i < PySequence_Size(obj); i++) {
+				if (i > 0) {
+					out += ", ";
+				}
+
+				if (out.size() >= limit) {
+					out += "...";
+					break;
+				}
+
+				if (dict) {
+					append_value(out, key, true, limit);
+					out += ": ";
+				}
+				else {
+					value = list ? PyList_GET_ITEM(obj, i) : PyTuple_GET_ITEM(obj, i);
 				}
+
+				append_value(out, value, true, limit);
+			}
+
+			out += list ? ']' : tuple ? ')' : '}';
+			return;
+		}
+
+		PyNewRef str = repr ? PyObject_Repr(obj) : PyObject_Str(obj);
+		if (!str || !PyString_Check(static_cast<PyObject*>(str))) {
+			PyErr_Clear();
+			out += std::format("<{} object>", obj->ob_type->tp_name);
+			return;
+		}
+
+		out.append(PyString_AS_STRING(static_cast<PyObject*>(str)), std::min<std::size_t>(PyString_GET_SIZE(static_cast<PyObject*>(str)), remaining));
+	}
+
+	std::string value_string(PyObject* obj, bool repr = false)
+	{
+		std::string value;
+		append_value(value, obj, repr, max_value);
+		if (value.size() >= max_value) {
+			value.resize(max_value);
+			value += "...";
+		}
+
+		return value;
+	}
+
+	// what is shown when a variable is expanded: the items of a dict or sequence, the attributes of an instance, class or object
+	// (functions aren't expanded, their attributes are rarely interesting)
+	struct children_t {
+		PyObject* dict = nullptr;
+		PyObject* sequence = nullptr;
+	};
+
+	children_t children_of(PyObject* obj)
+	{
+		if (PyDict_Check(obj)) {
+			return { .dict = obj };
+		}
+
+		if (PyList_Check(obj) || PyTuple_Check(obj)) {
+			return { .sequence = obj };
+		}
+
+		if (PyInstance_Check(obj)) {
+			return { .dict = reinterpret_cast<PyInstanceObject*>(obj)->in_dict };
+		}
+
+		if (PyClass_Check(obj)) {
+			return { .dict = reinterpret_cast<PyClassObject*>(obj)->cl_dict };
+		}
+
+		if (PyType_Check(obj)) {
+			return { .dict = reinterpret_cast<PyTypeObject*>(obj)->tp_dict };
+		}
+
+		if (!PyFunction_Check(obj)) {
+			const auto dictPtr = _PyObject_GetDictPtr(obj);
+			if (dictPtr && *dictPtr && PyDict_Check(*dictPtr)) {
+				return { .dict = *dictPtr };
 			}
 		}
+
+		return {};
 	}
 
-	return length;
+	std::size_t children_count(const children_t& children)
+	{
+		return static_cast<std::size_t>(children.dict ? PyDict_Size(children.dict) : children.sequence ? PySequence_Size(children.sequence) : 0);
+	}
+
+	// namedVariables/indexedVariables of an expandable variable or scope
+	void add_counts(json& variable, const children_t& children)
+	{
+		const auto size = children_count(children);
+		variable[children.sequence || size > page_size ? "indexedVariables" : "namedVariables"] = size;
+	}
+}
+
+debugger_session::debugger_session(debugger& debugger, asio::ip::tcp::socket socket, std::size_t writeLimit, output_policy policy)
+	: _debugger(debugger), _socket(std::move(socket)), _write_limit(writeLimit), _output_policy(policy)
+{
+
 }
 
 asio::awaitable<void> debugger_session::run()
 {
 	std::println("[session] running on port {}", _socket.remote_endpoint().port());
 	try {
-		auto buffer = asio::streambuf{};
+		auto parser = dap_parser{};
 		while (_socket.is_open()) {
-			const auto& [error, recvLength] = co_await asio::async_read_until(_socket, buffer, "\r\n\r\n", asio::as_tuple(asio::use_awaitable));
-			if (error) {
+			// all messages of one read are handled before reading again
+			const auto message = parser.next();
+			if (!message) {
+				std::println(stderr, "[session][error] {}, closing session.", message.error());
 				break;
 			}
 
-			auto pkgLength = get_packet_length(buffer);
-			if (pkgLength == 0) {
-				std::println(stderr, "Received empty packet, closing session.");
-				break;
-			}
+			if (!*message) {
+				const auto space = parser.prepare();
+				const auto& [error, recvLength] = co_await _socket.async_read_some(asio::buffer(space.data(), space.size()), asio::as_tuple(asio::use_awaitable));
+				if (error) {
+					break;
+				}
 
-			if (buffer.size() < pkgLength) {
-				co_await asio::async_read(_socket, buffer, asio::transfer_exactly(pkgLength - buffer.size()), asio::use_awaitable);
+				parser.commit(recvLength);
+				continue;
 			}
 
-			const char* data = asio::buffer_cast<const char*>(buffer.data());
-			json packet = json::parse(data, data + pkgLength);
-			buffer.consume(pkgLength);
+			json packet = json::parse(**message, nullptr, false);
+			if (packet.is_discarded()) {
+				std::println(stderr, "[session][error] Received invalid json: {}", **message);
+				continue;
+			}
 
 			const auto& type = packet["type"];
 			if (type == "request") {
@@ -107,6 +234,15 @@ asio::awaitable<void> debugger_session::run()
 				else if (command == "setBreakpoints") {
 					co_await handle_setBreakpoints(packet);
 				}
+				else if (command == "setFunctionBreakpoints") {
+					co_await handle_setFunctionBreakpoints(packet);
+				}
+				else if (command == "dataBreakpointInfo") {
+					co_await handle_dataBreakpointInfo(packet);
+				}
+				else if (command == "setDataBreakpoints") {
+					co_await handle_setDataBreakpoints(packet);
+				}
 				else if (command == "pause") {
 					co_await handle_pause(packet);
 				}
@@ -128,6 +264,9 @@ asio::awaitable<void> debugger_session::run()
 				else if (command == "evaluate") {
 					co_await handle_evaluate(packet);
 				}
+				else if (command == "bf2py") {
+					co_await handle_bf2py(packet);
+				}
 				else {
 					std::println(stderr, "[session][error] Unknown request: {}", packet.dump(4));
 				}
@@ -137,11 +276,29 @@ asio::awaitable<void> debugger_session::run()
 	catch (std::exception& e) {
 		std::println(stderr, "[session][error] {}", e.what());
 	}
+
+	// the writer's completion handler must run before the session can be replaced
+	{
+		std::lock_guard lock{ _write_mutex };
+		_closed = true;
+	}
+
+	asio::error_code ignored;
+	_socket.close(ignored);
+	auto writing = [this] {
+		std::lock_guard lock{ _write_mutex };
+		return _writing;
+	};
+
+	for (auto timer = asio::steady_timer{ _socket.get_executor() }; writing(); ) {
+		timer.expires_after(std::chrono::milliseconds(1));
+		co_await timer.async_wait(asio::as_tuple(asio::use_awaitable));
+	}
 }
 
 void debugger_session::send_modpath(const std::string& modPath)
 {
-	send_sync({
+	send({
 		{ "type", "event" },
 		{ "event", "bf2py" },
 		{ "body", {
@@ -153,75 +310,172 @@ void debugger_session::send_modpath(const std::string& modPath)
 
 void debugger_session::send_entry(std::uint32_t threadId)
 {
-	send_sync({
+	send({
 		{ "type", "event" },
 		{ "event", "stopped" },
 		{ "body", {
 			{ "reason", "entry" },
-			{ "threadId",  threadId }
+			{ "threadId",  threadId },
+			{ "allThreadsStopped", false }
 		}}
 	});
 }
 
 void debugger_session::send_step(std::uint32_t threadId)
 {
-	send_sync({
+	send({
 		{ "type", "event" },
 		{ "event", "stopped" },
 		{ "body", {
 			{ "reason", "step" },
-			{ "threadId",  threadId }
+			{ "threadId",  threadId },
+			{ "allThreadsStopped", false }
 		}}
 	});
 }
 
 void debugger_session::send_exception(std::uint32_t threadId, const std::string& text)
 {
-	send_sync({
+	send({
 		{ "type", "event" },
 		{ "event", "stopped" },
 		{ "body", {
 			{ "reason", "exception" },
 			{ "threadId",  threadId },
+			{ "allThreadsStopped", false },
 			{ "text",  text }
 		}}
 	});
 }
 
-void debugger_session::send_output(const std::string& output)
+void debugger_session::send_data_breakpoint(std::uint32_t threadId, const std::string& text)
 {
-	send_sync({
+	send({
 		{ "type", "event" },
-		{ "event", "output" },
+		{ "event", "stopped" },
 		{ "body", {
-			{ "category", "console" },
-			{ "output", output }
+			{ "reason", "data breakpoint" },
+			{ "threadId",  threadId },
+			{ "allThreadsStopped", false },
+			{ "text",  text }
 		}}
 	});
 }
 
-void debugger_session::send_output(const std::u8string& output)
+void debugger_session::send_function_breakpoint(std::uint32_t threadId, const std::string& text)
 {
-	send_sync({
+	send({
 		{ "type", "event" },
-		{ "event", "output" },
+		{ "event", "stopped" },
 		{ "body", {
-			{ "category", "console" },
-			{ "output", std::string{ output.begin(), output.end() } }
+			{ "reason", "function breakpoint" },
+			{ "threadId",  threadId },
+			{ "allThreadsStopped", false },
+			{ "text",  text }
 		}}
 	});
 }
 
-void debugger_session::send_sync(const json& data)
+void debugger_session::send_output(const std::string& output)
+{
+	auto outputFrame = output_frame(output);
+	std::lock_guard lock{ _write_mutex };
+	if (_closed) {
+		return;
+	}
+
+	// while there is a backlog, new output must not overtake it
+	if (_write_queued + outputFrame.size() <= _write_limit && _merged_output.empty() && _dropped_output == 0) {
+		enqueue(std::move(outputFrame));
+	}
+	else if (_output_policy == output_policy::MERGE && _merged_output.size() + output.size() <= _write_limit) {
+		_merged_output += output;
+	}
+	else {
+		_dropped_output++;
+	}
+}
+
+void debugger_session::send_output(const std::u8string& output)
+{
+	send_output(std::string{ output.begin(), output.end() });
+}
+
+void debugger_session::send(const json& data)
 {
-	auto dataBytes = data.dump();
-	_socket.send(asio::buffer(std::format("Content-Length: {}\r\n\r\n{}", dataBytes.size(), dataBytes)));
+	auto dataFrame = frame(data);
+	std::lock_guard lock{ _write_mutex };
+	if (!_closed) {
+		enqueue(std::move(dataFrame));
+	}
 }
 
-asio::awaitable<void> debugger_session::async_send(const json& data)
+void debugger_session::enqueue(std::string frame)
 {
-	auto dataBytes = data.dump();
-	co_await _socket.async_send(asio::buffer(std::format("Content-Length: {}\r\n\r\n{}", dataBytes.size(), dataBytes)), asio::use_awaitable);
+	_write_queued += frame.size();
+	_write_queue.push_back(std::move(frame));
+	if (!_writing) {
+		_writing = true;
+		asio::post(_socket.get_executor(), [this] { write_queued(); });
+	}
+}
+
+void debugger_session::write_queued()
+{
+	{
+		std::lock_guard lock{ _write_mutex };
+		if (_closed) {
+			_writing = false;
+			return;
+		}
+
+		// the backlog goes out once the client caught up with the queue
+		if ((!_merged_output.empty() || _dropped_output) && _write_queued <= _write_limit / 2) {
+			auto output = std::move(_merged_output);
+			_merged_output.clear();
+			if (_dropped_output) {
+				output += std::format("[bf2py] {} output events dropped, the client is too slow\n", _dropped_output);
+				_dropped_output = 0;
+			}
+
+			auto outputFrame = output_frame(output);
+			_write_queued += outputFrame.size();
+			_write_queue.push_back(std::move(outputFrame));
+		}
+
+		if (_write_queue.empty()) {
+			_writing = false;
+			return;
+		}
+
+		_writing_frames.clear();
+		std::ranges::move(_write_queue, std::back_inserter(_writing_frames));
+		_write_queue.clear();
+	}
+
+	std::size_t bytes = 0;
+	_writing_buffers.clear();
+	for (const auto& writingFrame : _writing_frames) {
+		_writing_buffers.push_back(asio::buffer(writingFrame));
+		bytes += writingFrame.size();
+	}
+
+	asio::async_write(_socket, _writing_buffers, [this, bytes](const asio::error_code& error, std::size_t) {
+		{
+			std::lock_guard lock{ _write_mutex };
+			_write_queued -= bytes;
+			if (error) {
+				// the reader notices the broken connection as well and ends the session
+				_closed = true;
+				_writing = false;
+				_write_queue.clear();
+				_write_queued = 0;
+				return;
+			}
+		}
+
+		write_queued();
+	});
 }
 
 asio::awaitable<void> debugger_session::async_send_response(const json& request, const json& body, bool success)
@@ -234,7 +488,8 @@ asio::awaitable<void> debugger_session::async_send_response(const json& request,
 		{ "body", body }
 	};
 
-	co_await async_send(response);
+	send(response);
+	co_return;
 }
 
 asio::awaitable<void> debugger_session::async_send_event(const std::string& event, const json& body)
@@ -248,20 +503,50 @@ asio::awaitable<void> debugger_session::async_send_event(const std::string& even
 		data["body"] = body;
 	}
 
-	co_await async_send(data);
+	send(data);
+	co_return;
 }
 
 void debugger_session::forget(std::uint32_t threadId)
 {
+	// variables and sources aren't tracked per thread, the client requests them again for the threads which are still stopped
 	_var_refs.clear();
+	_var_handles.clear();
 	_source_refs.clear();
+	std::erase_if(_frame_refs, [&](const auto& ref) { return ref.second.first == threadId; });
+}
+
+std::uint32_t debugger_session::var_ref(PyObject* obj)
+{
+	if (const auto it = _var_handles.find(obj); it != _var_handles.end()) {
+		return it->second;
+	}
+
+	Py_INCREF(obj);
+	const auto handle = _var_refs.add(obj);
+	if (handle) {
+		_var_handles.emplace(obj, handle);
+	}
+
+	return handle;
+}
+
+void debugger_session::release()
+{
+	_var_refs.clear();
+	_var_handles.clear();
 	_frame_refs.clear();
+	_source_refs.clear();
 }
 
 asio::awaitable<void> debugger_session::handle_initialize(const json& packet)
 {
 	co_await async_send_response(packet, {
 		{ "supportsConfigurationDoneRequest", true },
+		{ "supportsLogPoints", true },
+		{ "supportsFunctionBreakpoints", true },
+		{ "supportsDataBreakpoints", true },
+		{ "supportsSingleThreadExecutionRequests", true },
 		{ "exceptionBreakpointFilters", json::array({
 			{ { "filter", "never" }, { "label", "Never" } },
 			{ { "filter", "always" }, { "label", "Always" } },
@@ -274,27 +559,45 @@ asio::awaitable<void> debugger_session::handle_initialize(const json& packet)
 
 asio::awaitable<void> debugger_session::handle_attach(const json& packet)
 {
+	const auto args = packet.value("arguments", json::object());
+	const auto justMyCode = args.value("justMyCode", false);
+	const auto excludePaths = args.value("excludePaths", std::vector<std::string>{});
+	co_await _debugger.async_call([&] { _debugger.set_just_my_code(justMyCode, excludePaths); });
+
+	// the command line's +pyDebugTraceScope applies unless the client brings its own
+	if (args.contains("traceScope")) {
+		const auto traceScope = args.value("traceScope", std::vector<std::string>{});
+		co_await _debugger.async_call([&] { _debugger.set_trace_scope(traceScope); });
+	}
+
 	co_await async_send_response(packet, {});
 }
 
 asio::awaitable<void> debugger_session::handle_configurationDone(const json& packet)
 {
+	// from now on breakpoints, exception filters and pauses install the trace function
+	co_await _debugger.async_call([&] { _debugger.attach(); });
 	_initialized = true;
 	co_await async_send_response(packet, {});
 }
 
 asio::awaitable<void> debugger_session::handle_threads(const json& packet)
 {
-	auto threads = json::array();
-	for (auto interpreter = PyInterpreterState_Head(); interpreter; interpreter = PyInterpreterState_Next(interpreter)) {
-		for (auto thread = PyInterpreterState_ThreadHead(interpreter); thread; thread = PyThreadState_Next(thread)) {
-			auto threadName = !thread->next ? "bf2 (main)" : std::format("bf2 ({})", thread->thread_id);
-			threads.push_back({
-				{ "id", thread->thread_id },
-				{ "name", threadName }
-			});
+	// the thread states may only be walked while holding the GIL (the other threads keep running while one is stopped)
+	auto threads = co_await _debugger.async_call([&] {
+		auto threads = json::array();
+		for (auto interpreter = PyInterpreterState_Head(); interpreter; interpreter = PyInterpreterState_Next(interpreter)) {
+			for (auto thread = PyInterpreterState_ThreadHead(interpreter); thread; thread = PyThreadState_Next(thread)) {
+				auto threadName = !thread->next ? "bf2 (main)" : std::format("bf2 ({})", thread->thread_id);
+				threads.push_back({
+					{ "id", thread->thread_id },
+					{ "name", threadName }
+				});
+			}
 		}
-	}
+
+		return threads;
+	});
 
 	co_await async_send_response(packet, {
 		{ "threads", threads }
@@ -304,58 +607,69 @@ asio::awaitable<void> debugger_session::handle_threads(const json& packet)
 asio::awaitable<void> debugger_session::handle_stackTrace(const json& packet)
 {
 	const auto threadId = packet["arguments"]["threadId"].get<std::uint32_t>();
-	PyFrameObject* frame = nullptr;
-	if (threadId == _debugger.current_thread()) {
-		frame = _debugger.current_frame();
-	}
-	else {
-		for (auto interpreter = PyInterpreterState_Head(); interpreter; interpreter = PyInterpreterState_Next(interpreter)) {
-			for (auto thread = PyInterpreterState_ThreadHead(interpreter); thread; thread = PyThreadState_Next(thread)) {
-				if (thread->thread_id == threadId) {
-					frame = thread->frame;
-					break;
+	auto stackFrames = co_await _debugger.async_call([&] {
+		// only the frames of a stopped thread stay alive until forget, the other threads just get a look at their stack
+		PyFrameObject* frame = _debugger.stopped_frame(threadId);
+		const auto stopped = frame != nullptr;
+		if (!frame) {
+			for (auto interpreter = PyInterpreterState_Head(); interpreter; interpreter = PyInterpreterState_Next(interpreter)) {
+				for (auto thread = PyInterpreterState_ThreadHead(interpreter); thread; thread = PyThreadState_Next(thread)) {
+					if (thread->thread_id == threadId) {
+						frame = thread->frame;
+						break;
+					}
 				}
 			}
 		}
-	}
 
-	if (frame == nullptr) {
-		co_await async_send_response(packet, {
-			{ "error", std::format("Invalid threadId '{}'", threadId) }
-		}, false);
-		co_return;
-	}
+		if (frame == nullptr) {
+			return json{};
+		}
 
-	auto stackFrames = json::array();
-	for (std::uint32_t frameId = 1; frame; frame = frame->f_back, frameId++) {
-		assert(frame->f_code && "f_code is never NULL");
+		auto stackFrames = json::array();
+		for (; frame; frame = frame->f_back) {
+			assert(frame->f_code && "f_code is never NULL");
 
-		auto filename = _debugger.canonic(PyString_AsString(frame->f_code->co_filename));
-		auto source = json::object();
-		source["name"] = filename;
+			auto filename = _debugger.canonic(PyString_AsString(frame->f_code->co_filename));
+			auto source = json::object();
+			source["name"] = filename;
 
-		if (filename.starts_with("<") && filename.ends_with(">")) {
-			auto sourceRef = _last_source_id++;
-			source["sourceReference"] = sourceRef;
-			_source_refs.emplace(sourceRef, frame);
-		}
-		else if (filename.contains(".zip")) {
-			auto sourceRef = _last_source_id++;
-			source["sourceReference"] = sourceRef;
-			_source_refs.emplace(sourceRef, filename);
-		}
-		else {
-			source["path"] = filename;
+			if (filename.starts_with("<") && filename.ends_with(">")) {
+				auto sourceRef = _last_source_id++;
+				source["sourceReference"] = sourceRef;
+				_source_refs.emplace(sourceRef, frame);
+			}
+			else if (filename.contains(".zip")) {
+				auto sourceRef = _last_source_id++;
+				source["sourceReference"] = sourceRef;
+				_source_refs.emplace(sourceRef, filename);
+			}
+			else {
+				source["path"] = filename;
+			}
+
+			const auto frameId = ++_last_frame_id;
+			if (stopped) {
+				_frame_refs[frameId] = { threadId, frame };
+			}
+
+			stackFrames.push_back({
+				{ "id", frameId },
+				{ "name", PyString_AsString(frame->f_code->co_name) },
+				{ "line", frame->f_lineno },
+				{ "column", 1 },
+				{ "source", source }
+			});
 		}
 
-		_frame_refs[frameId] = frame;
-		stackFrames.push_back({
-			{ "id", frameId },
-			{ "name", PyString_AsString(frame->f_code->co_name) },
-			{ "line", frame->f_lineno },
-			{ "column", 1 },
-			{ "source", source }
-		});
+		return stackFrames;
+	});
+
+	if (stackFrames.is_null()) {
+		co_await async_send_response(packet, {
+			{ "error", std::format("Invalid threadId '{}'", threadId) }
+		}, false);
+		co_return;
 	}
 
 	co_await async_send_response(packet, {
@@ -366,102 +680,140 @@ asio::awaitable<void> debugger_session::handle_stackTrace(const json& packet)
 asio::awaitable<void> debugger_session::handle_scopes(const json& packet)
 {
 	const auto frameId = packet["arguments"]["frameId"].get<std::uint32_t>();
-	const auto it = _frame_refs.find(frameId);
-	if (it == _frame_refs.end()) {
-		co_await async_send_response(packet, {
-			{ "error", std::format("Invalid frameId '{}'", frameId) }
-		}, false);
-		co_return;
-	}
 
-	auto scopes = json::array();
-	const auto& frame = it->second;
-	if (!frame->f_locals) {
-		PyFrame_FastToLocals(frame);
-	}
+	// the frame ids are only touched by the python thread, which also drops them in forget
+	auto scopes = co_await _debugger.async_call([&] -> std::optional<json> {
+		const auto it = _frame_refs.find(frameId);
+		if (it == _frame_refs.end() || !_debugger.stopped(it->second.first)) {
+			return std::nullopt;
+		}
 
-	if (frame->f_locals) {
-		const auto refId = ::pyObjectHash(frame->f_locals);
-		scopes.push_back({
-			{ "name", "Locals" },
-			{ "presentationHint", "locals" },
-			{ "variablesReference", refId }
-		});
-		_var_refs[refId] = frame->f_locals;
-	}
+		const auto frame = it->second.second;
+		auto scopes = json::array();
+		if (!frame->f_locals) {
+			PyFrame_FastToLocals(frame);
+		}
 
-	if (frame->f_globals && frame->f_globals != frame->f_locals) {
-		const auto refId = ::pyObjectHash(frame->f_globals);
-		scopes.push_back({
-			{ "name", "Globals" },
-			{ "variablesReference", refId }
-		});
-		_var_refs[refId] = frame->f_globals;
-	}
+		if (frame->f_locals) {
+			const auto refId = var_ref(frame->f_locals);
+			auto& scope = scopes.emplace_back(json{
+				{ "name", "Locals" },
+				{ "presentationHint", "locals" },
+				{ "variablesReference", refId }
+			});
+			add_counts(scope, children_of(frame->f_locals));
+		}
 
-	co_await async_send_response(packet, {
-		{ "scopes", scopes }
+		if (frame->f_globals && frame->f_globals != frame->f_locals) {
+			const auto refId = var_ref(frame->f_globals);
+			auto& scope = scopes.emplace_back(json{
+				{ "name", "Globals" },
+				{ "variablesReference", refId }
+			});
+			add_counts(scope, children_of(frame->f_globals));
+		}
+
+		return scopes;
 	});
-}
 
-asio::awaitable<void> debugger_session::handle_variables(const json& packet)
-{
-	const auto varId = packet["arguments"]["variablesReference"].get<std::uint32_t>();
-	auto it = _var_refs.find(varId);
-	if (it == _var_refs.end()) {
+	if (!scopes) {
 		co_await async_send_response(packet, {
-			{ "error", std::format("Invalid variablesReference '{}'", varId) }
+			{ "error", std::format("Invalid frameId '{}'", frameId) }
 		}, false);
 		co_return;
 	}
 
-	// currently only dicts are stored in var_refs
-	PyObject* dict = it->second;
-	PyObject* key, * value;
-	int pos = 0;
+	co_await async_send_response(packet, {
+		{ "scopes", *scopes }
+	});
+}
 
-	auto variables = json::array();
-	while (PyDict_Next(dict, &pos, &key, &value)) {
-		std::string type;
-		std::uint32_t varId = 0;
-		if (PyInt_Check(value)) {
-			type = "int";
-		}
-		else if (PyFloat_Check(value)) {
-			type = "float";
-		}
-		else if (PyString_Check(value)) {
-			type = "string";
-		}
-		else if (PyBool_Check(value)) {
-			type = "bool";
+asio::awaitable<void> debugger_session::handle_variables(const json& packet)
+{
+	// a page of the children (all of them without count), only the children of the page are converted to strings
+	const auto& args = packet["arguments"];
+	const auto varId = args["variablesReference"].get<std::uint32_t>();
+	const auto start = args.value("start", std::size_t{ 0 });
+	const auto count = args.value("count", std::size_t{ 0 });
+	const auto filter = args.value("filter", "");
+
+	// the handles are only touched by the python thread, which also resets them in forget
+	auto variables = co_await _debugger.async_call([&] -> std::optional<json> {
+		const auto ref = _var_refs.find(varId);
+		if (!ref) {
+			return std::nullopt;
 		}
-		else if (PyList_Check(value)) {
-			type = "list";
+
+		const auto children = children_of(*ref);
+		const auto size = children_count(children);
+		const auto indexed = children.sequence || size > page_size;
+		auto variables = json::array();
+		if ((filter == "named" && indexed) || (filter == "indexed" && !indexed)) {
+			return variables;
 		}
-		else if (PyDict_Check(value)) {
-			type = "dict";
-			varId = ::pyObjectHash(key);
-			_var_refs[varId] = value;
+
+		auto add = [&](std::string name, PyObject* value) {
+			std::string type;
+			if (PyInt_Check(value)) {
+				type = "int";
+			}
+			else if (PyFloat_Check(value)) {
+				type = "float";
+			}
+			else if (PyString_Check(value)) {
+				type = "string";
+			}
+			else if (PyBool_Check(value)) {
+				type = "bool";
+			}
+			else {
+				type = value->ob_type->tp_name;
+			}
+
+			const auto valueChildren = children_of(value);
+			const auto valueId = children_count(valueChildren) > 0 ? var_ref(value) : 0;
+			auto& variable = variables.emplace_back(json{
+				{ "name", std::move(name) },
+				{ "type", type },
+				{ "value", value_string(value) },
+				{ "variablesReference", valueId }
+			});
+
+			if (valueId) {
+				add_counts(variable, valueChildren);
+			}
+		};
+
+		const auto end = count == 0 ? size : std::min(size, start + count);
+		if (children.sequence) {
+			const auto list = PyList_Check(children.sequence);
+			for (auto i = start; i < end; i++) {
+				const auto index = static_cast<int>(i);
+				add(std::format("[{}]", i), list ? PyList_GET_ITEM(children.sequence, index) : PyTuple_GET_ITEM(children.sequence, index));
+			}
 		}
-		else {
-			type = "object";
+		else if (children.dict) {
+			PyObject* key, * value;
+			int pos = 0;
+			for (std::size_t i = 0; i < end && PyDict_Next(children.dict, &pos, &key, &value); i++) {
+				if (i >= start) {
+					add(PyString_Check(key) ? std::string{ PyString_AS_STRING(key) } : value_string(key, true), value);
+				}
+			}
 		}
 
-		PyNewRef keyStr = PyObject_Str(key);
-		PyNewRef valueStr = PyObject_Str(value);
-		auto variable = json::object({
-			{ "name", std::string{PyString_AsString(keyStr)} },
-			{ "type", type },
-			{ "value", std::string{PyString_AsString(valueStr)} },
-			{ "variablesReference", varId }
-		});
+		return variables;
+	});
 
-		variables.push_back(variable);
+	if (!variables) {
+		co_await async_send_response(packet, {
+			{ "error", std::format("Invalid variablesReference '{}'", varId) }
+		}, false);
+		co_return;
 	}
 
 	co_await async_send_response(packet, {
-		{ "variables", variables }
+		{ "variables", *variables }
 	});
 }
 
@@ -528,20 +880,53 @@ asio::awaitable<void> debugger_session::handle_setBreakpoints(const json& packet
 	if (!path.empty()) {
 		std::ranges::transform(path, path.begin(), [](auto c) { return std::tolower(c); });
 
-		auto& fileBreaks = _debugger.breaks()[path];
-		fileBreaks.clear();
+		// the breakpoints are read by the trace function, so they must be modified on the python thread
+		response["breakpoints"] = co_await _debugger.async_call([&] {
+			auto fileBreaks = bdb::line_breaks_t{};
+			auto validatedBreaks = json::array();
+			for (const auto& bp : packet["arguments"].value("breakpoints", json::array())) {
+				const auto line = bp["line"].get<std::uint32_t>();
+				auto breakpoint = Breakpoint(path, line, false, bp.value("condition", ""));
+
+				// compile the condition once, syntax errors are reported here instead of on every hit
+				if (!breakpoint.condition.empty()) {
+					auto code = py_utils::compile(breakpoint.condition, "<condition>", Py_eval_input);
+					if (!code) {
+						validatedBreaks.push_back({
+							{ "verified", false },
+							{ "line", line },
+							{ "message", code.error() }
+						});
+						continue;
+					}
 
-		auto validatedBreaks = json::array();
-		for (const auto& bp : packet["arguments"].value("breakpoints", json::array())) {
-			const auto line = bp["line"].get<std::uint32_t>();
-			fileBreaks[line].push_back(
-				Breakpoint(path, line, false, bp.value("condition", ""))
-			);
-			validatedBreaks.push_back({
-				{ "verified", true }
-			});
-		}
-		response["breakpoints"] = validatedBreaks;
+					breakpoint.code = *code;
+				}
+
+				if (const auto logMessage = bp.value("logMessage", ""); !logMessage.empty()) {
+					auto log = bdb::compile_log_message(logMessage);
+					if (!log) {
+						validatedBreaks.push_back({
+							{ "verified", false },
+							{ "line", line },
+							{ "message", log.error() }
+						});
+						continue;
+					}
+
+					breakpoint.log = std::move(*log);
+				}
+
+				fileBreaks[line].push_back(std::move(breakpoint));
+				validatedBreaks.push_back({
+					{ "verified", true },
+					{ "line", line }
+				});
+			}
+
+			_debugger.set_breaks(path, std::move(fileBreaks));
+			return validatedBreaks;
+		});
 	}
 
 	co_await async_send_response(packet, response);
@@ -562,43 +947,183 @@ asio::awaitable<void> debugger_session::handle_setExceptionBreakpoints(const jso
 		}
 	}
 
-	_debugger.set_exception_mode(exmode);
+	co_await _debugger.async_call([&] { _debugger.set_exception_mode(exmode); });
 
 	co_await async_send_response(packet, {});
 }
 
+asio::awaitable<void> debugger_session::handle_setFunctionBreakpoints(const json& packet)
+{
+	auto breaks = std::vector<FunctionBreakpoint>{};
+	auto validatedBreaks = json::array();
+	for (const auto& bp : packet["arguments"].value("breakpoints", json::array())) {
+		const auto name = bp.value("name", "");
+		if (name.empty() || name.ends_with('.')) {
+			validatedBreaks.push_back({
+				{ "verified", false },
+				{ "message", "expected a function name like module.function" }
+			});
+			continue;
+		}
+
+		breaks.emplace_back(name);
+		validatedBreaks.push_back({
+			{ "verified", true }
+		});
+	}
+
+	// resolved against the code objects when they are called
+	co_await _debugger.async_call([&] { _debugger.set_function_breaks(std::move(breaks)); });
+
+	co_await async_send_response(packet, {
+		{ "breakpoints", validatedBreaks }
+	});
+}
+
+asio::awaitable<void> debugger_session::handle_dataBreakpointInfo(const json& packet)
+{
+	const auto& args = packet["arguments"];
+	const auto name = args.value("name", "");
+	const auto varId = args.value("variablesReference", std::uint32_t{ 0 });
+	const auto body = co_await _debugger.async_call([&] {
+		// items of a dict and attributes of an instance, class or object
+		const auto ref = _var_refs.find(varId);
+		PyObject* dict = ref ? children_of(*ref).dict : nullptr;
+		if (name.empty() || !dict) {
+			return json{
+				{ "dataId", nullptr },
+				{ "description", "only variables of a scope, a dict or an object can be watched" }
+			};
+		}
+
+		auto& targets = _debugger.data_targets();
+		auto offer = [&](const std::string& dataId, DataBreakpoint target) {
+			targets.erase(dataId);
+			targets.emplace(dataId, std::move(target));
+			return json{
+				{ "dataId", dataId },
+				{ "description", name },
+				{ "accessTypes", json::array({ "write" }) },
+				{ "canPersist", false }
+			};
+		};
+
+		// f_locals of a function is only a snapshot of its fast locals, so the frame's slot is watched instead
+		for (const auto& [frameId, ref] : _frame_refs) {
+			const auto frame = ref.second;
+			const auto code = frame->f_code;
+			if (frame->f_locals != dict || !(code->co_flags & CO_OPTIMIZED)) {
+				continue;
+			}
+
+			for (int i = 0; i < code->co_nlocals; i++) {
+				if (name == PyString_AS_STRING(PyTuple_GET_ITEM(code->co_varnames, i))) {
+					return offer(std::format("local:{}:{}", static_cast<void*>(frame), name), DataBreakpoint(name, reinterpret_cast<PyObject*>(frame), nullptr, i));
+				}
+			}
+		}
+
+		PyNewRef key = PyString_FromString(name.c_str());
+		if (!key || !PyDict_GetItem(dict, key)) {
+			PyErr_Clear();
+			return json{
+				{ "dataId", nullptr },
+				{ "description", std::format("'{}' cannot be watched", name) }
+			};
+		}
+
+		return offer(std::format("dict:{}:{}", static_cast<void*>(dict), name), DataBreakpoint(name, dict, key));
+	});
+
+	co_await async_send_response(packet, body);
+}
+
+asio::awaitable<void> debugger_session::handle_setDataBreakpoints(const json& packet)
+{
+	// like breakpoints, the watched variables are read by the trace function
+	auto breakpoints = co_await _debugger.async_call([&] {
+		auto& targets = _debugger.data_targets();
+		auto breaks = std::vector<DataBreakpoint>{};
+		auto validatedBreaks = json::array();
+		for (const auto& bp : packet["arguments"].value("breakpoints", json::array())) {
+			const auto it = targets.find(bp.value("dataId", ""));
+			if (it == targets.end()) {
+				validatedBreaks.push_back({
+					{ "verified", false },
+					{ "message", "unknown dataId" }
+				});
+				continue;
+			}
+
+			auto& target = it->second;
+			breaks.emplace_back(target.name, target.container, target.key, target.local);
+			validatedBreaks.push_back({
+				{ "verified", true }
+			});
+		}
+
+		_debugger.set_data_breaks(std::move(breaks));
+		return validatedBreaks;
+	});
+
+	co_await async_send_response(packet, {
+		{ "breakpoints", breakpoints }
+	});
+}
+
 asio::awaitable<void> debugger_session::handle_pause(const json& packet)
 {
-	_debugger.pause();
+	const auto threadId = packet["arguments"].value("threadId", debugger::thread_id_t{ -1 });
+	co_await _debugger.async_call([&] { _debugger.pause(threadId); });
 	co_await async_send_response(packet, {});
 }
 
 asio::awaitable<void> debugger_session::handle_continue(const json& packet)
 {
-	_debugger.set_continue();
-	_debugger.state(debugger::Status::Running);
-	co_await async_send_response(packet, {});
+	const auto singleThread = packet["arguments"].value("singleThread", false);
+	co_await async_resume(packet, [&](bdb::thread_state& ts, PyFrameObject*) { _debugger.set_continue(ts); });
+	co_await async_send_response(packet, {
+		{ "allThreadsContinued", !singleThread }
+	});
 }
 
 asio::awaitable<void> debugger_session::handle_next(const json& packet)
 {
-	_debugger.set_next(_debugger.current_frame());
-	_debugger.state(debugger::Status::Running);
-	co_await async_send_response(packet, {});
+	const auto resumed = co_await async_resume(packet, [&](bdb::thread_state& ts, PyFrameObject* frame) { _debugger.set_next(ts, frame); });
+	co_await async_send_response(packet, {}, resumed);
 }
 
 asio::awaitable<void> debugger_session::handle_stepIn(const json& packet)
 {
-	_debugger.set_step();
-	_debugger.state(debugger::Status::Running);
-	co_await async_send_response(packet, {});
+	const auto resumed = co_await async_resume(packet, [&](bdb::thread_state& ts, PyFrameObject*) { _debugger.set_step(ts); });
+	co_await async_send_response(packet, {}, resumed);
 }
 
 asio::awaitable<void> debugger_session::handle_stepOut(const json& packet)
 {
-	_debugger.set_return(_debugger.current_frame());
-	_debugger.state(debugger::Status::Running);
-	co_await async_send_response(packet, {});
+	const auto resumed = co_await async_resume(packet, [&](bdb::thread_state& ts, PyFrameObject* frame) { _debugger.set_return(ts, frame); });
+	co_await async_send_response(packet, {}, resumed);
+}
+
+asio::awaitable<bool> debugger_session::async_resume(const json& packet, std::function<void(bdb::thread_state&, PyFrameObject*)> step)
+{
+	// only the requested thread runs again with singleThread, otherwise all other stopped threads continue
+	const auto& args = packet["arguments"];
+	const auto threadId = args.value("threadId", debugger::thread_id_t{ -1 });
+	const auto singleThread = args.value("singleThread", false);
+	co_return co_await _debugger.async_call([&] {
+		auto frame = _debugger.stopped_frame(threadId);
+		if (frame) {
+			step(_debugger.thread(threadId), frame);
+			_debugger.resume(threadId);
+		}
+
+		if (!singleThread) {
+			_debugger.resume_others(threadId);
+		}
+
+		return frame != nullptr;
+	});
 }
 
 asio::awaitable<void> debugger_session::handle_disconnect(const json& packet)
@@ -619,46 +1144,156 @@ asio::awaitable<void> debugger_session::handle_evaluate(const nlohmann::json& pa
 	// this needs some improvement
 	// https://docs.python.org/2.7/faq/extending.html#how-do-i-tell-incomplete-input-from-invalid-input
 	auto expression = packet["arguments"]["expression"].get<std::string>();
-	auto frame = _debugger.current_frame();
+	const auto frameId = packet["arguments"].value("frameId", std::uint32_t{ 0 });
 
-	auto result = py_utils::call([&] -> PyObject* {
-		auto code = Py_CompileString(expression.c_str(), "<evaluate>", Py_single_input);
-		if (code) {
-			PyObject* _code = code;
-			auto evalResult = PyEval_EvalCode(reinterpret_cast<PyCodeObject*>(_code), frame->f_globals, frame->f_locals);
-			if (evalResult) {
-				return evalResult;
-			}
+	auto message = co_await _debugger.async_call([&] {
+		// the frame of the request, or the frame of any stopped thread (e.g. evaluate from the debug console without a selected frame)
+		PyFrameObject* frame = nullptr;
+		if (auto it = _frame_refs.find(frameId); it != _frame_refs.end() && _debugger.stopped(it->second.first)) {
+			frame = it->second.second;
 		}
-
-		PyErr_Print();
-		return nullptr;
-	});
-
-	std::u8string message;
-	if (!result) {
-		message = result.error();
-	}
-	else {
-		PyNewRef pyResult = result->result;
-		if (pyResult && pyResult != Py_None) {
-			auto str = PyObject_Repr(pyResult);
-			message = reinterpret_cast<char8_t*>(PyString_AS_STRING(str));
-			Py_DECREF(str);
+		else {
+			frame = _debugger.stopped_frame();
 		}
-		else if (!result->err.empty()) {
-			message = result->err;
+
+		if (!frame) {
+			return std::u8string{ u8"no stopped thread" };
 		}
-		else if (!result->out.empty()) {
-			message = result->out;
+
+		auto result = py_utils::call([&] -> PyObject* {
+			auto code = Py_CompileString(expression.c_str(), "<evaluate>", Py_single_input);
+			if (code) {
+				PyObject* _code = code;
+				auto evalResult = PyEval_EvalCode(reinterpret_cast<PyCodeObject*>(_code), frame->f_globals, frame->f_locals);
+				if (evalResult) {
+					return evalResult;
+				}
+			}
+
+			PyErr_Print();
+			return nullptr;
+		});
+
+		std::u8string message;
+		if (!result) {
+			message = result.error();
 		}
 		else {
-			message = u8"unable to get result";
+			PyNewRef pyResult = result->result;
+			if (pyResult && pyResult != Py_None) {
+				auto str = PyObject_Repr(pyResult);
+				message = reinterpret_cast<char8_t*>(PyString_AS_STRING(str));
+				Py_DECREF(str);
+			}
+			else if (!result->err.empty()) {
+				message = result->err;
+			}
+			else if (!result->out.empty()) {
+				message = result->out;
+			}
+			else {
+				message = u8"unable to get result";
+			}
 		}
-	}
+
+		return message;
+	});
 
 	co_await async_send_response(packet, {
 		{ "result", std::string{ message.begin(), message.end() } },
 		{ "variablesReference", 0 }
 	});
-}
\ No newline at end of file
+}
+asio::awaitable<void> debugger_session::handle_bf2py(const json& packet)
+{
+	// custom requests (vscode: session.customRequest("bf2py", { type: "...", ... }))
+	const auto args = packet.value("arguments", json::object());
+	const auto type = args.value("type", "");
+	auto& profiler = _debugger.profiler();
+	if (type == "profile.start") {
+		if (args.value("clear", true)) {
+			co_await _debugger.async_call([&] { profiler.clear(); });
+		}
+
+		profiler.start(args.value("rate", 1000u));
+		co_await async_send_response(packet, {});
+	}
+	else if (type == "profile.stop") {
+		profiler.stop();
+		co_await async_send_response(packet, { { "samples", profiler.samples() } });
+	}
+	else if (type == "profile.dump") {
+		auto functions = json::array();
+		for (const auto& function : profiler.functions()) {
+			functions.push_back({
+				{ "name", function.name },
+				{ "self", function.self },
+				{ "total", function.total }
+			});
+		}
+
+		co_await async_send_response(packet, {
+			{ "samples", profiler.samples() },
+			{ "functions", functions },
+			{ "folded", profiler.folded() }
+		});
+	}
+	else if (type == "callprofile.start") {
+		const auto clear = args.value("clear", true);
+		const auto started = co_await _debugger.async_call([&] { return _debugger.call_profiler().start(clear); });
+		co_await async_send_response(packet, {}, started);
+	}
+	else if (type == "callprofile.stop") {
+		co_await _debugger.async_call([&] { _debugger.call_profiler().stop(); });
+		co_await async_send_response(packet, {});
+	}
+	else if (type == "callprofile.dump") {
+		const auto stats = co_await _debugger.async_call([&] { return _debugger.call_profiler().functions(); });
+		auto functions = json::array();
+		for (const auto& function : stats) {
+			functions.push_back({
+				{ "name", function.name },
+				{ "calls", function.calls },
+				{ "inclusive_ns", function.inclusive.count() },
+				{ "exclusive_ns", function.exclusive.count() }
+			});
+		}
+
+		co_await async_send_response(packet, {
+			{ "functions", functions },
+			{ "table", function_profiler::format(stats) }
+		});
+	}
+	else if (type == "recorder.start") {
+		const auto capacity = args.value("capacity", std::size_t{ 4096 });
+		co_await _debugger.async_call([&] { _debugger.enable_recorder(capacity); });
+		co_await async_send_response(packet, {});
+	}
+	else if (type == "recorder.stop") {
+		co_await _debugger.async_call([&] { _debugger.enable_recorder(0); });
+		co_await async_send_response(packet, {});
+	}
+	else if (type == "recorder.dump") {
+		const auto count = args.value("count", std::size_t{ 256 });
+		const auto entries = co_await _debugger.async_call([&] { return _debugger.recorded_events(count); });
+		auto events = json::array();
+		for (const auto& entry : entries) {
+			events.push_back({
+				{ "thread", entry.thread },
+				{ "file", entry.filename },
+				{ "line", entry.line },
+				{ "function", entry.function },
+				{ "event", flight_recorder::event_name(entry.what) },
+				{ "time_ns", std::chrono::duration_cast<std::chrono::nanoseconds>(entry.time.time_since_epoch()).count() }
+			});
+		}
+
+		co_await async_send_response(packet, {
+			{ "events", events },
+			{ "text", flight_recorder::format(entries) }
+		});
+	}
+	else {
+		co_await async_send_response(packet, { { "error", std::format("unknown bf2py request: {}", type) } }, false);
+	}
+}
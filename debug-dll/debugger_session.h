@@ -1,48 +1,98 @@
 #pragma once
 #include "asio.h"
+#include "bdb.h"
+#include "handle_table.h"
 #include "python.h"
+#include <cstddef>
 #include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
 #include <nlohmann/json.hpp>
 #include <string>
 #include <unordered_map>
+#include <utility>
 #include <variant>
+#include <vector>
 
 namespace bf2py {
 	class debugger;
 	class debugger_session
 	{
+	public:
+		// what happens to output events while the client falls behind (more than the write limit is queued):
+		// DROP discards them, MERGE collects their text (up to the write limit) into one event which is sent once the client caught up,
+		// either way the number of dropped events is reported when the client caught up
+		enum class output_policy : unsigned char {
+			DROP,
+			MERGE
+		};
+
+	private:
 		debugger& _debugger;
 		asio::ip::tcp::socket _socket;
 		bool _initialized = false;
 
-		std::unordered_map<std::uint32_t, PyFrameObject*> _frame_refs;
-		std::unordered_map<std::uint32_t, PyObject*> _var_refs;
+		// complete frames (header and body), queued by any thread without blocking
+		// and written by a single writer on the io_context, which gathers everything queued into one async_write
+		std::mutex _write_mutex;
+		std::deque<std::string> _write_queue;
+		std::size_t _write_queued = 0; // bytes queued or being written
+		std::size_t _write_limit;
+		output_policy _output_policy;
+		std::string _merged_output;
+		std::size_t _dropped_output = 0;
+		bool _writing = false;
+		bool _closed = false;
+		// io thread only, the frames of the async_write in progress
+		std::vector<std::string> _writing_frames;
+		std::vector<asio::const_buffer> _writing_buffers;
+
+		// frame ids are unique across threads, so that every stopped thread can be inspected at the same time
+		std::uint32_t _last_frame_id = 0;
+		std::unordered_map<std::uint32_t, std::pair<std::uint32_t, PyFrameObject*>> _frame_refs; // frameId -> (threadId, frame), python thread only, frames of stopped threads until forget
+		// variablesReference -> the expanded object (a strong reference until forget), python thread only
+		handle_table<PyNewRef> _var_refs;
+		std::unordered_map<PyObject*, std::uint32_t> _var_handles; // object -> its variablesReference, cleared with _var_refs
 		std::uint32_t _last_source_id = 1;
 		std::unordered_map<std::uint32_t, std::string> _source_cache;
 		std::unordered_map<std::uint32_t, std::variant<std::string, PyFrameObject*>> _source_refs;
 		std::unordered_map<std::string, std::string> _zipcache;
 
 	public:
-		debugger_session(debugger& debugger, asio::ip::tcp::socket socket);
+		debugger_session(debugger& debugger, asio::ip::tcp::socket socket, std::size_t writeLimit = 1024 * 1024, output_policy policy = output_policy::MERGE);
 
 		bool initialized() const { return _initialized; }
 		asio::awaitable<void> run();
 
-		void send_sync(const nlohmann::json& data);
-		asio::awaitable<void> async_send(const nlohmann::json& data);
+		// never blocks (can be called from any thread), the frames are written in the order they were sent
+		void send(const nlohmann::json& data);
 
 		void send_modpath(const std::string& modPath);
 		void send_entry(std::uint32_t threadId);
 		void send_step(std::uint32_t threadId);
 		void send_exception(std::uint32_t threadId, const std::string& text);
+		void send_data_breakpoint(std::uint32_t threadId, const std::string& text);
+		void send_function_breakpoint(std::uint32_t threadId, const std::string& text);
 		void send_output(const std::string& output);
 		void send_output(const std::u8string& output);
 
 		void forget(std::uint32_t threadId);
+		// python thread: drops all references to python objects once the client is gone
+		void release();
 
 	private:
+		// _write_mutex must be held
+		void enqueue(std::string frame);
+		// io thread: writes everything queued, until the queue is empty
+		void write_queued();
+		// python thread: the variablesReference of obj, the same one while it is expanded more than once (0 if there are too many)
+		std::uint32_t var_ref(PyObject* obj);
+
 		asio::awaitable<void> async_send_response(const nlohmann::json& request, const nlohmann::json& body, bool success = true);
 		asio::awaitable<void> async_send_event(const std::string& event, const nlohmann::json& body);
+		// applies step to the stopped thread of the request (continue/next/stepIn/stepOut) and lets it run, false if it isn't stopped
+		asio::awaitable<bool> async_resume(const nlohmann::json& packet, std::function<void(bdb::thread_state&, PyFrameObject*)> step);
 
 		asio::awaitable<void> handle_initialize(const nlohmann::json& packet);
 		asio::awaitable<void> handle_attach(const nlohmann::json& packet);
@@ -54,6 +104,9 @@ namespace bf2py {
 		asio::awaitable<void> handle_source(const nlohmann::json& packet);
 		asio::awaitable<void> handle_setBreakpoints(const nlohmann::json& packet);
 		asio::awaitable<void> handle_setExceptionBreakpoints(const nlohmann::json& packet);
+		asio::awaitable<void> handle_setFunctionBreakpoints(const nlohmann::json& packet);
+		asio::awaitable<void> handle_dataBreakpointInfo(const nlohmann::json& packet);
+		asio::awaitable<void> handle_setDataBreakpoints(const nlohmann::json& packet);
 		asio::awaitable<void> handle_pause(const nlohmann::json& packet);
 		asio::awaitable<void> handle_continue(const nlohmann::json& packet);
 		asio::awaitable<void> handle_next(const nlohmann::json& packet);
@@ -61,5 +114,6 @@ namespace bf2py {
 		asio::awaitable<void> handle_stepOut(const nlohmann::json& packet);
 		asio::awaitable<void> handle_disconnect(const nlohmann::json& packet);
 		asio::awaitable<void> handle_evaluate(const nlohmann::json& packet);
+		asio::awaitable<void> handle_bf2py(const nlohmann::json& packet);
 	};
 }
\ No newline at end of file
@@ -0,0 +1,105 @@
+#include "flight_recorder.h"
+#include <algorithm>
+#include <bit>
+#include <format>
+#include <fstream>
+#include <print>
+using namespace bf2py;
+
+flight_recorder::~flight_recorder()
+{
+    if (Py_IsInitialized()) {
+        clear();
+    }
+}
+
+void flight_recorder::resize(std::size_t capacity)
+{
+    clear();
+    _events.clear();
+    _events.shrink_to_fit();
+    if (capacity > 0) {
+        _events.resize(std::bit_ceil(capacity));
+        _mask = _events.size() - 1;
+    }
+    else {
+        _mask = 0;
+    }
+}
+
+void flight_recorder::clear()
+{
+    for (auto& slot : _events) {
+        Py_XDECREF(slot.code);
+        slot = {};
+    }
+
+    _count = 0;
+}
+
+std::vector<flight_recorder::entry> flight_recorder::last(const std::vector<std::pair<long, const flight_recorder*>>& recorders, std::size_t n)
+{
+    std::vector<entry> entries;
+    for (const auto& [thread, recorder] : recorders) {
+        const auto available = static_cast<std::size_t>(std::min<std::uint64_t>(recorder->_count, recorder->_events.size()));
+        for (auto i = recorder->_count - std::min(available, n); i < recorder->_count; i++) {
+            const auto& event = recorder->_events[i & recorder->_mask];
+            entries.push_back({
+                .thread = thread,
+                .filename = PyString_AS_STRING(event.code->co_filename),
+                .function = PyString_AS_STRING(event.code->co_name),
+                .line = event.line,
+                .what = event.what,
+                .time = clock::time_point{ clock::duration{ event.time } }
+            });
+        }
+    }
+
+    // the threads interleave, the last n of all of them are the newest n after sorting by time
+    std::ranges::stable_sort(entries, {}, &entry::time);
+    if (entries.size() > n) {
+        entries.erase(entries.begin(), entries.end() - n);
+    }
+
+    return entries;
+}
+
+std::string flight_recorder::format(const std::vector<entry>& entries)
+{
+    std::string text;
+    if (entries.empty()) {
+        return text;
+    }
+
+    const auto end = entries.back().time;
+    for (const auto& entry : entries) {
+        const auto offset = std::chrono::duration<double, std::milli>(entry.time - end).count();
+        text += std::format("{:>12.3f}ms {:>8} {:<9} {}:{} {}\n", offset, entry.thread, event_name(entry.what), entry.filename, entry.line, entry.function);
+    }
+
+    return text;
+}
+
+bool flight_recorder::write(const std::filesystem::path& path, const std::string& header, const std::vector<entry>& entries)
+{
+    auto file = std::ofstream{ path, std::ios::binary };
+    if (!file) {
+        std::println(stderr, "[recorder] failed to open {}", path.string());
+        return false;
+    }
+
+    file << header << '\n' << format(entries);
+    return static_cast<bool>(file);
+}
+
+const char* flight_recorder::event_name(int what)
+{
+    switch (what) {
+    case PyTrace_CALL: return "call";
+    case PyTrace_EXCEPTION: return "exception";
+    case PyTrace_LINE: return "line";
+    case PyTrace_RETURN: return "return";
+    }
+
+    return "?";
+}
@@ -0,0 +1,73 @@
+#pragma once
+#ifndef _BF2PY_FLIGHT_RECORDER_H_
+#define _BF2PY_FLIGHT_RECORDER_H_
+
+#include "python.h"
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace bf2py {
+	// the most recent trace events of one thread in a fixed-size ring (for post-mortem analysis),
+	// it is only written by its own thread while holding the GIL, so it needs no locking and never allocates after resize
+	class flight_recorder {
+	public:
+		using clock = std::chrono::steady_clock;
+
+		struct event {
+			PyCodeObject* code = nullptr; // strong reference, so the code object outlives its events
+			int line = 0;
+			int what = 0; // PyTrace_*
+			clock::rep time = 0;
+		};
+
+		// an event resolved for output
+		struct entry {
+			long thread;
+			std::string filename;
+			std::string function;
+			int line;
+			int what;
+			clock::time_point time;
+		};
+
+	private:
+		std::vector<event> _events;
+		std::size_t _mask = 0;
+		std::uint64_t _count = 0; // events recorded so far, (_count & _mask) is the next slot
+
+	public:
+		flight_recorder() = default;
+		flight_recorder(const flight_recorder&) = delete;
+		flight_recorder& operator=(const flight_recorder&) = delete;
+		~flight_recorder();
+
+		// the capacity is rounded up to a power of 2, 0 releases the buffer (and its code objects)
+		void resize(std::size_t capacity);
+		void clear();
+		bool enabled() const { return !_events.empty(); }
+
+		// hot path, called for every trace event while the recorder is enabled
+		void record(PyFrameObject* frame, int what)
+		{
+			auto& slot = _events[_count++ & _mask];
+			auto previous = slot.code;
+			Py_INCREF(frame->f_code);
+			slot = { frame->f_code, frame->f_lineno, what, clock::now().time_since_epoch().count() };
+			Py_XDECREF(previous);
+		}
+
+		// the last n events of the given recorders (by thread id), oldest first
+		static std::vector<entry> last(const std::vector<std::pair<long, const flight_recorder*>>& recorders, std::size_t n);
+		// one line per event, the time relative to the last event
+		static std::string format(const std::vector<entry>& entries);
+		static bool write(const std::filesystem::path& path, const std::string& header, const std::vector<entry>& entries);
+		static const char* event_name(int what);
+	};
+}
+
+#endif
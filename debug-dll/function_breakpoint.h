@@ -0,0 +1,52 @@
+#pragma once
+#include <algorithm>
+#include <cctype>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// breaks when a function is called, e.g. "game.scoringCommon.onPlayerKilled" or just "onPlayerKilled" (any file)
+struct FunctionBreakpoint
+{
+    const std::string name;
+    std::string function; // co_name
+    std::vector<std::string> modules; // path suffixes (without extension) of the defining file, empty = any file
+    std::size_t hits = 0;
+
+    explicit FunctionBreakpoint(const std::string& name)
+        : name(name)
+    {
+        const auto dot = name.rfind('.');
+        function = name.substr(dot == std::string::npos ? 0 : dot + 1);
+        if (dot == std::string::npos) {
+            return;
+        }
+
+        // "package.module.function" or "package.module.Class.method" (code objects don't know their class)
+        auto module = name.substr(0, dot);
+        std::ranges::replace(module, '.', '/');
+        std::ranges::transform(module, module.begin(), [](auto c) { return static_cast<char>(std::tolower(c)); });
+        modules.push_back(module);
+        if (const auto slash = module.rfind('/'); slash != std::string::npos) {
+            modules.push_back(module.substr(0, slash));
+        }
+    }
+
+    // filename is a code object's co_filename
+    bool matches(std::string filename) const
+    {
+        if (modules.empty()) {
+            return true;
+        }
+
+        std::ranges::replace(filename, '\\', '/');
+        std::ranges::transform(filename, filename.begin(), [](auto c) { return static_cast<char>(std::tolower(c)); });
+        if (const auto dot = filename.rfind('.'); dot != std::string::npos && filename.find('/', dot) == std::string::npos) {
+            filename.erase(dot);
+        }
+
+        return std::ranges::any_of(modules, [&](const auto& module) {
+            return filename == module || (filename.ends_with(module) && filename[filename.size() - module.size() - 1] == '/');
+        });
+    }
+};
@@ -0,0 +1,376 @@
+#include "function_profiler.h"
+#include <algorithm>
+#include <bit>
+#include <format>
+#include <intrin.h>
+#include <print>
+#include <unordered_map>
+using namespace bf2py;
+
+struct function_profiler::thread_profile : PyObject {
+    struct entry {
+        PyCodeObject* code = nullptr;
+        std::uint64_t calls = 0;
+        std::uint64_t inclusive = 0;
+        std::uint64_t exclusive = 0;
+        std::uint32_t active = 0; // recursion depth, inclusive time is only counted for the outermost call
+    };
+
+    struct activation {
+        PyFrameObject* frame;
+        std::uint32_t index;
+        std::uint64_t start;
+        std::uint64_t children = 0;
+    };
+
+    // open addressing with linear probing, the size is a power of 2
+    std::vector<entry> table;
+    std::size_t used = 0;
+    std::vector<activation> stack;
+
+    std::uint32_t index_of(PyCodeObject* code)
+    {
+        if ((used + 1) * 2 > table.size()) {
+            grow();
+        }
+
+        const auto mask = table.size() - 1;
+        for (auto i = hash(code) & mask;; i = (i + 1) & mask) {
+            auto& e = table[i];
+            if (e.code == code) {
+                return static_cast<std::uint32_t>(i);
+            }
+
+            if (!e.code) {
+                Py_INCREF(code);
+                e.code = code;
+                used++;
+                return static_cast<std::uint32_t>(i);
+            }
+        }
+    }
+
+    void enter(PyFrameObject* frame)
+    {
+        const auto index = index_of(frame->f_code);
+        auto& e = table[index];
+        e.calls++;
+        e.active++;
+        stack.push_back({ .frame = frame, .index = index, .start = __rdtsc() });
+    }
+
+    void leave(PyFrameObject* frame)
+    {
+        if (stack.empty() || stack.back().frame != frame) {
+            // entered before the profiler was started
+            return;
+        }
+
+        const auto call = stack.back();
+        stack.pop_back();
+
+        const auto elapsed = __rdtsc() - call.start;
+        auto& e = table[call.index];
+        e.exclusive += elapsed - std::min(elapsed, call.children);
+        if (--e.active == 0) {
+            e.inclusive += elapsed;
+        }
+
+        if (!stack.empty()) {
+            stack.back().children += elapsed;
+        }
+    }
+
+private:
+    static std::size_t hash(PyCodeObject* code)
+    {
+        // the low bits are always zero (alignment)
+        return static_cast<std::size_t>((reinterpret_cast<std::uintptr_t>(code) >> 4) * 0x9E3779B9u);
+    }
+
+    void grow()
+    {
+        auto old = std::move(table);
+        table.assign(std::max<std::size_t>(64, old.size() * 2), entry{});
+
+        // the activations on the stack refer to table indices
+        std::vector<std::uint32_t> moved(old.size());
+        const auto mask = table.size() - 1;
+        for (std::size_t j = 0; j < old.size(); j++) {
+            if (!old[j].code) {
+                continue;
+            }
+
+            auto i = hash(old[j].code) & mask;
+            while (table[i].code) {
+                i = (i + 1) & mask;
+            }
+
+            table[i] = old[j];
+            moved[j] = static_cast<std::uint32_t>(i);
+        }
+
+        for (auto& call : stack) {
+            call.index = moved[call.index];
+        }
+    }
+};
+
+namespace {
+    using thread_profile = function_profiler::thread_profile;
+
+    int profile_function(PyObject* obj, PyFrameObject* frame, int what, PyObject* arg)
+    {
+        (void)arg;
+        // python 2.3 only sends call and return (also when unwinding an exception) to the profile function
+        if (what == PyTrace_CALL) {
+            static_cast<thread_profile*>(obj)->enter(frame);
+        }
+        else if (what == PyTrace_RETURN) {
+            static_cast<thread_profile*>(obj)->leave(frame);
+        }
+
+        return 0;
+    }
+
+    PyTypeObject bf2PyThreadProfileType = {
+        .ob_refcnt = 1,
+        .tp_name = (char*)"bf2py.ThreadProfile",
+        .tp_basicsize = sizeof(thread_profile),
+        .tp_flags = Py_TPFLAGS_DEFAULT
+    };
+
+    // the callable registered via threading.setprofile
+    struct bf2PyProfileHook : PyObject {
+        function_profiler* profiler;
+    };
+
+    PyTypeObject bf2PyProfileHookType = {
+        .ob_refcnt = 1,
+        .tp_name = (char*)"bf2py.ProfileHook",
+        .tp_basicsize = sizeof(bf2PyProfileHook),
+        .tp_flags = Py_TPFLAGS_DEFAULT
+    };
+
+    bool set_thread_profile(const char* function, PyObject* hook)
+    {
+        PyNewRef threadingModule = PyImport_ImportModule((char*)"threading");
+        if (!threadingModule) {
+            PyErr_Clear();
+            return false;
+        }
+
+        PyNewRef result = PyObject_CallMethod(threadingModule, (char*)function, (char*)"(O)", hook);
+        if (!result) {
+            std::println(stderr, "[profiler] failed to call threading.{}: {}", function, py_utils::fetch_error());
+            return false;
+        }
+
+        return true;
+    }
+}
+
+function_profiler::~function_profiler()
+{
+    if (Py_IsInitialized()) {
+        stop();
+        clear();
+
+        if (_pyProfileHook) {
+            Py_DECREF(_pyProfileHook);
+        }
+    }
+}
+
+bool function_profiler::pyInit()
+{
+    static bool typesInitialized = false;
+    if (!typesInitialized) {
+        bf2PyThreadProfileType.tp_dealloc = [](PyObject* self) {
+            auto profile = static_cast<thread_profile*>(self);
+            for (auto& e : profile->table) {
+                Py_XDECREF(e.code);
+            }
+
+            profile->~thread_profile();
+            PyObject_Del(self);
+        };
+
+        bf2PyProfileHookType.tp_call = [](PyObject* self, PyObject* args, PyObject* kwds) -> PyObject* {
+            static_cast<bf2PyProfileHook*>(self)->profiler->install_current_thread();
+            Py_RETURN_NONE;
+        };
+
+        typesInitialized = PyType_Ready(&bf2PyThreadProfileType) == 0 && PyType_Ready(&bf2PyProfileHookType) == 0;
+        if (!typesInitialized) {
+            std::println(stderr, "[profiler] failed to initialize the profiler types");
+        }
+    }
+
+    return typesInitialized;
+}
+
+PyObject* function_profiler::py_profile_hook()
+{
+    if (!_pyProfileHook) {
+        auto* self = PyObject_NEW(bf2PyProfileHook, &bf2PyProfileHookType);
+        if (!self) {
+            return nullptr;
+        }
+
+        self->profiler = this;
+        _pyProfileHook = self;
+    }
+
+    return _pyProfileHook;
+}
+
+void function_profiler::install_current_thread()
+{
+    if (!_running) {
+        PyEval_SetProfile(nullptr, nullptr);
+        return;
+    }
+
+    auto* profile = PyObject_NEW(thread_profile, &bf2PyThreadProfileType);
+    if (!profile) {
+        PyErr_Clear();
+        return;
+    }
+
+    // PyObject_NEW only initializes the PyObject header
+    auto refcnt = profile->ob_refcnt;
+    auto type = profile->ob_type;
+    new (profile) thread_profile();
+    profile->ob_refcnt = refcnt;
+    profile->ob_type = type;
+
+    // the thread state holds the second reference
+    PyEval_SetProfile(profile_function, profile);
+    _threads.push_back(profile);
+}
+
+bool function_profiler::start(bool clear)
+{
+    if (!pyInit()) {
+        return false;
+    }
+
+    if (_running) {
+        return true;
+    }
+
+    if (clear || _threads.empty()) {
+        this->clear();
+        _start_ticks = __rdtsc();
+        _start_time = std::chrono::steady_clock::now();
+    }
+
+    _running = true;
+    for (auto interpreter = PyInterpreterState_Head(); interpreter; interpreter = PyInterpreterState_Next(interpreter)) {
+        for (auto thread = PyInterpreterState_ThreadHead(interpreter); thread; thread = PyThreadState_Next(thread)) {
+            auto currThread = PyThreadState_Swap(thread);
+            install_current_thread();
+            PyThreadState_Swap(currThread);
+        }
+    }
+
+    // threads started afterwards install it themselves
+    if (auto hook = py_profile_hook()) {
+        set_thread_profile("setprofile", hook);
+    }
+
+    return true;
+}
+
+void function_profiler::stop()
+{
+    if (!_running) {
+        return;
+    }
+
+    _running = false;
+    _stop_ticks = __rdtsc();
+    _stop_time = std::chrono::steady_clock::now();
+
+    for (auto interpreter = PyInterpreterState_Head(); interpreter; interpreter = PyInterpreterState_Next(interpreter)) {
+        for (auto thread = PyInterpreterState_ThreadHead(interpreter); thread; thread = PyThreadState_Next(thread)) {
+            if (thread->c_profilefunc != profile_function) {
+                continue;
+            }
+
+            auto currThread = PyThreadState_Swap(thread);
+            PyEval_SetProfile(nullptr, nullptr);
+            PyThreadState_Swap(currThread);
+        }
+    }
+
+    set_thread_profile("setprofile", Py_None);
+}
+
+void function_profiler::clear()
+{
+    for (auto profile : _threads) {
+        Py_DECREF(profile);
+    }
+
+    _threads.clear();
+}
+
+std::vector<function_profiler::function_stats> function_profiler::functions()
+{
+    auto stopTicks = _stop_ticks;
+    auto stopTime = _stop_time;
+    if (_running) {
+        stopTicks = __rdtsc();
+        stopTime = std::chrono::steady_clock::now();
+    }
+
+    const auto elapsed = std::chrono::duration<double, std::nano>(stopTime - _start_time).count();
+    const auto nsPerTick = stopTicks > _start_ticks ? elapsed / static_cast<double>(stopTicks - _start_ticks) : 0.0;
+    const auto toNs = [nsPerTick](std::uint64_t ticks) {
+        return std::chrono::nanoseconds(static_cast<std::int64_t>(static_cast<double>(ticks) * nsPerTick));
+    };
+
+    std::unordered_map<PyCodeObject*, function_stats> stats;
+    for (auto profile : _threads) {
+        for (const auto& e : profile->table) {
+            if (!e.code || e.calls == 0) {
+                continue;
+            }
+
+            auto& function = stats[e.code];
+            if (function.name.empty()) {
+                function.name = std::format("{} ({}:{})", PyString_AS_STRING(e.code->co_name), PyString_AS_STRING(e.code->co_filename), e.code->co_firstlineno);
+            }
+
+            function.calls += e.calls;
+            function.inclusive += toNs(e.inclusive);
+            function.exclusive += toNs(e.exclusive);
+        }
+    }
+
+    std::vector<function_stats> result;
+    result.reserve(stats.size());
+    for (auto& [code, function] : stats) {
+        result.push_back(std::move(function));
+    }
+
+    std::ranges::sort(result, std::greater{}, &function_stats::exclusive);
+    return result;
+}
+
+std::string function_profiler::format(const std::vector<function_stats>& functions)
+{
+    auto result = std::format("{:>10} {:>12} {:>12}  {}\n", "calls", "total ms", "self ms", "function");
+    for (const auto& function : functions) {
+        result += std::format("{:>10} {:>12.3f} {:>12.3f}  {}\n",
+            function.calls,
+            std::chrono::duration<double, std::milli>(function.inclusive).count(),
+            std::chrono::duration<double, std::milli>(function.exclusive).count(),
+            function.name
+        );
+    }
+
+    return result;
+}
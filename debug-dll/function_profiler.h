@@ -0,0 +1,60 @@
+#pragma once
+#ifndef _BF2PY_FUNCTION_PROFILER_H_
+#define _BF2PY_FUNCTION_PROFILER_H_
+
+#include "python.h"
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace bf2py {
+	// deterministic profiler based on PyEval_SetProfile (call and return events only, no line events)
+	// every thread records into its own table (its c_profileobj), so the hot path needs no locking;
+	// all methods must be called on a python thread (the GIL keeps the tables consistent)
+	class function_profiler {
+	public:
+		struct function_stats {
+			std::string name;
+			std::uint64_t calls = 0;
+			std::chrono::nanoseconds inclusive{};
+			std::chrono::nanoseconds exclusive{};
+		};
+
+		struct thread_profile;
+
+	private:
+		std::vector<thread_profile*> _threads; // one reference each, the data survives the thread
+		PyObject* _pyProfileHook = nullptr;
+		bool _running = false;
+
+		// rdtsc ticks are converted to time by comparing against steady_clock over the whole profile
+		std::uint64_t _start_ticks = 0;
+		std::chrono::steady_clock::time_point _start_time;
+		std::uint64_t _stop_ticks = 0;
+		std::chrono::steady_clock::time_point _stop_time;
+
+	public:
+		~function_profiler();
+
+		// installs the profile function on all threads (and via threading.setprofile on new ones)
+		bool start(bool clear = true);
+		void stop();
+		// releases the recorded data (and the referenced code objects)
+		void clear();
+		bool running() const { return _running; }
+
+		// summed up over all threads, sorted by exclusive time
+		std::vector<function_stats> functions();
+		static std::string format(const std::vector<function_stats>& functions);
+
+		// called by threading.setprofile's trampoline on the first event of a new thread
+		void install_current_thread();
+
+	private:
+		static bool pyInit();
+		PyObject* py_profile_hook();
+	};
+}
+
+#endif
@@ -0,0 +1,77 @@
+#pragma once
+#ifndef _BF2PY_HANDLE_TABLE_H_
+#define _BF2PY_HANDLE_TABLE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace bf2py {
+	// hands out small, non-zero handles (e.g. DAP variablesReference) for values, which are looked up in O(1):
+	// the handle is (generation, slot), clear() only starts a new generation and reuses the slots,
+	// so handles of an earlier generation are never resolved to the values which replaced them
+	template<typename T>
+	class handle_table {
+	public:
+		using handle_t = std::uint32_t;
+
+		// DAP handles must be positive 32 bit signed numbers: 20 bits slot + 1, 11 bits generation
+		static constexpr handle_t slot_bits = 20;
+		static constexpr std::size_t max_slots = (std::size_t{ 1 } << slot_bits) - 1;
+		static constexpr handle_t max_generation = (handle_t{ 1 } << (31 - slot_bits)) - 1;
+
+	private:
+		struct slot {
+			T value{};
+			handle_t generation = 0;
+		};
+
+		std::vector<slot> _slots;
+		std::size_t _used = 0;
+		handle_t _generation = 1;
+
+	public:
+		// 0 if the table is full
+		handle_t add(T value)
+		{
+			if (_used == max_slots) {
+				return 0;
+			}
+
+			if (_used == _slots.size()) {
+				_slots.emplace_back();
+			}
+
+			auto& entry = _slots[_used++];
+			entry.value = std::move(value);
+			entry.generation = _generation;
+			return (_generation << slot_bits) | static_cast<handle_t>(_used);
+		}
+
+		// nullptr for 0, handles of an earlier generation and handles which were never handed out
+		const T* find(handle_t handle) const
+		{
+			const auto index = static_cast<std::size_t>(handle & max_slots);
+			if (index == 0 || index > _used || _slots[index - 1].generation != handle >> slot_bits) {
+				return nullptr;
+			}
+
+			return &_slots[index - 1].value;
+		}
+
+		// invalidates all handles and releases the values (e.g. the references they hold)
+		void clear()
+		{
+			for (std::size_t i = 0; i < _used; i++) {
+				_slots[i].value = T{};
+			}
+
+			_used = 0;
+			_generation = _generation == max_generation ? 1 : _generation + 1;
+		}
+
+		std::size_t size() const { return _used; }
+	};
+}
+
+#endif
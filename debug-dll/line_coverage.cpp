@@ -0,0 +1,278 @@
+#include "line_coverage.h"
+#include <algorithm>
+#include <format>
+#include <fstream>
+#include <map>
+#include <print>
+#include <ranges>
+#include <string>
+#include <string_view>
+using namespace bf2py;
+
+namespace {
+    // frames of the current thread and their coverage (nullptr = fully covered, nothing left to record)
+    struct active_frame {
+        PyFrameObject* frame;
+        line_coverage::code_coverage* coverage;
+    };
+
+    thread_local std::vector<active_frame> active_frames;
+
+    std::size_t hash(PyCodeObject* code)
+    {
+        // the low bits are always zero (alignment)
+        return static_cast<std::size_t>((reinterpret_cast<std::uintptr_t>(code) >> 4) * 0x9E3779B9u);
+    }
+
+    struct file_lines {
+        std::map<line_coverage::line_t, bool> lines; // line -> hit
+        std::vector<std::pair<const line_coverage::code_coverage*, bool>> functions; // function -> any line hit
+    };
+
+    // code objects of the same file (module, classes, functions) merged into one line set
+    std::map<std::string, file_lines> by_file(const std::deque<line_coverage::code_coverage>& codes)
+    {
+        std::map<std::string, file_lines> files;
+        for (const auto& coverage : codes) {
+            auto& file = files[PyString_AS_STRING(coverage.code->co_filename)];
+            for (const auto& range : line_table{ coverage.code }.ranges()) {
+                file.lines[range.line] |= coverage.hit.test(range.line);
+            }
+
+            file.functions.emplace_back(&coverage, coverage.hit.any());
+        }
+
+        return files;
+    }
+
+    // file names are written into XML attributes as they are (e.g. "<string>" or a path containing '&')
+    std::string xml_escape(std::string_view text)
+    {
+        std::string result;
+        result.reserve(text.size());
+        for (const auto c : text) {
+            switch (c) {
+            case '&': result += "&amp;"; break;
+            case '<': result += "&lt;"; break;
+            case '>': result += "&gt;"; break;
+            case '"': result += "&quot;"; break;
+            default: result += c; break;
+            }
+        }
+
+        return result;
+    }
+}
+
+line_coverage::~line_coverage()
+{
+    if (Py_IsInitialized()) {
+        clear();
+    }
+}
+
+void line_coverage::record(PyFrameObject* frame, int event)
+{
+    switch (event) {
+    case PyTrace_CALL: {
+        auto coverage = lookup(frame->f_code);
+        active_frames.push_back({ frame, coverage && coverage->remaining ? coverage : nullptr });
+        break;
+    }
+    case PyTrace_LINE:
+        if (!active_frames.empty() && active_frames.back().frame == frame) {
+            if (auto coverage = active_frames.back().coverage) {
+                mark(*coverage, frame->f_lineno);
+            }
+        }
+        else if (auto coverage = lookup(frame->f_code)) {
+            // entered before the coverage was enabled
+            mark(*coverage, frame->f_lineno);
+        }
+        break;
+    case PyTrace_RETURN:
+        if (!active_frames.empty() && active_frames.back().frame == frame) {
+            active_frames.pop_back();
+        }
+        break;
+    }
+}
+
+void line_coverage::mark(code_coverage& coverage, line_t line)
+{
+    if (coverage.hit.test(line) || !coverage.executable.test(line)) {
+        return;
+    }
+
+    coverage.hit.set(line);
+    if (--coverage.remaining == 0) {
+        // fully covered: the remaining events of this code object return right away
+        for (auto& active : active_frames) {
+            if (active.coverage == &coverage) {
+                active.coverage = nullptr;
+            }
+        }
+    }
+}
+
+line_coverage::code_coverage* line_coverage::lookup(PyCodeObject* code)
+{
+    if (!_table.empty()) {
+        const auto mask = _table.size() - 1;
+        for (auto i = hash(code) & mask; _table[i].code; i = (i + 1) & mask) {
+            if (_table[i].code == code) {
+                return _table[i].coverage;
+            }
+        }
+    }
+
+    return add(code);
+}
+
+line_coverage::code_coverage* line_coverage::add(PyCodeObject* code)
+{
+    if ((_used + 1) * 2 > _table.size()) {
+        grow();
+    }
+
+    const auto table = line_table{ code };
+    auto executable = line_bitset{ table.first_line(), table.last_line() };
+    for (const auto& range : table.ranges()) {
+        executable.set(range.line);
+    }
+
+    Py_INCREF(code);
+    const auto remaining = executable.count();
+    auto& coverage = _codes.emplace_back(code_coverage{
+        .code = code,
+        .executable = std::move(executable),
+        .hit = line_bitset{ table.first_line(), table.last_line() },
+        .remaining = remaining
+    });
+
+    const auto mask = _table.size() - 1;
+    auto i = hash(code) & mask;
+    while (_table[i].code) {
+        i = (i + 1) & mask;
+    }
+
+    _table[i] = { code, &coverage };
+    _used++;
+
+    // register the nested functions and classes as well, so that the ones which are never called show up with 0 hits
+    const auto consts = code->co_consts;
+    for (int j = 0, n = PyTuple_GET_SIZE(consts); j < n; j++) {
+        auto item = PyTuple_GET_ITEM(consts, j);
+        if (PyCode_Check(item)) {
+            lookup(reinterpret_cast<PyCodeObject*>(item));
+        }
+    }
+
+    return &coverage;
+}
+
+void line_coverage::grow()
+{
+    auto old = std::move(_table);
+    _table.assign(std::max<std::size_t>(256, old.size() * 2), slot{});
+
+    const auto mask = _table.size() - 1;
+    for (const auto& entry : old) {
+        if (!entry.code) {
+            continue;
+        }
+
+        auto i = hash(entry.code) & mask;
+        while (_table[i].code) {
+            i = (i + 1) & mask;
+        }
+
+        _table[i] = entry;
+    }
+}
+
+void line_coverage::clear()
+{
+    // the frame stacks of the other threads still point into _codes, but are only used while recording
+    active_frames.clear();
+    _table.clear();
+    _used = 0;
+    for (auto& coverage : _codes) {
+        Py_DECREF(coverage.code);
+    }
+
+    _codes.clear();
+}
+
+bool line_coverage::write_lcov(const std::filesystem::path& path) const
+{
+    auto file = std::ofstream{ path, std::ios::binary };
+    if (!file) {
+        std::println(stderr, "[coverage] failed to open {}", path.string());
+        return false;
+    }
+
+    for (const auto& [filename, lines] : by_file(_codes)) {
+        file << std::format("TN:\nSF:{}\n", filename);
+
+        std::size_t functionsHit = 0;
+        for (const auto& [coverage, hit] : lines.functions) {
+            file << std::format("FN:{},{}\n", coverage->code->co_firstlineno, PyString_AS_STRING(coverage->code->co_name));
+        }
+
+        for (const auto& [coverage, hit] : lines.functions) {
+            file << std::format("FNDA:{},{}\n", hit ? 1 : 0, PyString_AS_STRING(coverage->code->co_name));
+            functionsHit += hit;
+        }
+
+        file << std::format("FNF:{}\nFNH:{}\n", lines.functions.size(), functionsHit);
+
+        std::size_t linesHit = 0;
+        for (const auto& [line, hit] : lines.lines) {
+            file << std::format("DA:{},{}\n", line, hit ? 1 : 0);
+            linesHit += hit;
+        }
+
+        file << std::format("LF:{}\nLH:{}\nend_of_record\n", lines.lines.size(), linesHit);
+    }
+
+    return file.good();
+}
+
+bool line_coverage::write_cobertura(const std::filesystem::path& path) const
+{
+    auto file = std::ofstream{ path, std::ios::binary };
+    if (!file) {
+        std::println(stderr, "[coverage] failed to open {}", path.string());
+        return false;
+    }
+
+    const auto rate = [](std::size_t hit, std::size_t total) {
+        return total ? static_cast<double>(hit) / static_cast<double>(total) : 1.0;
+    };
+
+    const auto files = by_file(_codes);
+    std::size_t totalLines = 0;
+    std::size_t totalHit = 0;
+    for (const auto& [filename, lines] : files) {
+        totalLines += lines.lines.size();
+        totalHit += std::ranges::count(lines.lines | std::views::values, true);
+    }
+
+    file << "<?xml version=\"1.0\" ?>\n";
+    file << std::format("<coverage line-rate=\"{:.4f}\" branch-rate=\"0\" lines-covered=\"{}\" lines-valid=\"{}\" version=\"bf2py\">\n", rate(totalHit, totalLines), totalHit, totalLines);
+    file << "\t<packages>\n\t\t<package name=\"bf2py\">\n\t\t\t<classes>\n";
+    for (const auto& [filename, lines] : files) {
+        const auto hit = static_cast<std::size_t>(std::ranges::count(lines.lines | std::views::values, true));
+        file << std::format("\t\t\t\t<class name=\"{0}\" filename=\"{0}\" line-rate=\"{1:.4f}\" branch-rate=\"0\">\n", xml_escape(filename), rate(hit, lines.lines.size()));
+        file << "\t\t\t\t\t<methods/>\n\t\t\t\t\t<lines>\n";
+        for (const auto& [line, lineHit] : lines.lines) {
+            file << std::format("\t\t\t\t\t\t<line number=\"{}\" hits=\"{}\"/>\n", line, lineHit ? 1 : 0);
+        }
+
+        file << "\t\t\t\t\t</lines>\n\t\t\t\t</class>\n";
+    }
+
+    file << "\t\t\t</classes>\n\t\t</package>\n\t</packages>\n</coverage>\n";
+    return file.good();
+}
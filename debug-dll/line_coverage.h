@@ -0,0 +1,61 @@
+#pragma once
+#ifndef _BF2PY_LINE_COVERAGE_H_
+#define _BF2PY_LINE_COVERAGE_H_
+
+#include "line_table.h"
+#include "python.h"
+#include <cstddef>
+#include <deque>
+#include <filesystem>
+#include <vector>
+
+namespace bf2py {
+	// executed lines per code object, recorded from the trace function's call/line/return events
+	class line_coverage {
+	public:
+		using line_t = line_table::line_t;
+
+		struct code_coverage {
+			PyCodeObject* code; // strong reference
+			line_bitset executable; // from co_lnotab
+			line_bitset hit;
+			std::size_t remaining; // executable lines not yet hit, 0 = fully covered
+		};
+
+	private:
+		// open addressing (linear probing) keyed by the code object, the size is a power of 2
+		struct slot {
+			PyCodeObject* code = nullptr;
+			code_coverage* coverage = nullptr;
+		};
+
+		std::vector<slot> _table;
+		std::size_t _used = 0;
+		std::deque<code_coverage> _codes; // stable addresses
+
+	public:
+		line_coverage() = default;
+		line_coverage(const line_coverage&) = delete;
+		line_coverage& operator=(const line_coverage&) = delete;
+		~line_coverage();
+
+		// hot path, called for every trace event while coverage is enabled
+		void record(PyFrameObject* frame, int event);
+
+		// releases all code objects
+		void clear();
+		const auto& codes() const { return _codes; }
+
+		bool write_lcov(const std::filesystem::path& path) const;
+		bool write_cobertura(const std::filesystem::path& path) const;
+
+	private:
+		// adds code objects on their first lookup
+		code_coverage* lookup(PyCodeObject* code);
+		code_coverage* add(PyCodeObject* code);
+		void grow();
+		void mark(code_coverage& coverage, line_t line);
+	};
+}
+
+#endif
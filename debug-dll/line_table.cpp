@@ -0,0 +1,91 @@
+#include "line_table.h"
+#include <algorithm>
+using namespace bf2py;
+
+line_table::line_table(PyCodeObject* code)
+    : _first_line(code->co_firstlineno), _last_line(code->co_firstlineno)
+{
+    // same algorithm as dis.findlinestarts:
+    // co_lnotab is a sequence of (bytecode increment, line increment) byte pairs
+    const auto lnotab = reinterpret_cast<const unsigned char*>(PyString_AS_STRING(code->co_lnotab));
+    const auto size = PyString_GET_SIZE(code->co_lnotab);
+    const auto codeSize = static_cast<int>(PyString_GET_SIZE(code->co_code));
+
+    int addr = 0;
+    line_t line = code->co_firstlineno;
+    std::optional<line_t> lastLine;
+    auto add = [&](int start, line_t line) {
+        if (!_ranges.empty()) {
+            _ranges.back().end = start;
+        }
+
+        _ranges.push_back({ line, start, codeSize });
+        _last_line = std::max(_last_line, line);
+    };
+
+    for (int i = 0; i + 1 < size; i += 2) {
+        const auto addrIncr = lnotab[i];
+        const auto lineIncr = lnotab[i + 1];
+        if (addrIncr) {
+            if (line != lastLine) {
+                add(addr, line);
+                lastLine = line;
+            }
+
+            addr += addrIncr;
+        }
+
+        line += lineIncr;
+    }
+
+    if (line != lastLine && addr < codeSize) {
+        add(addr, line);
+    }
+}
+
+const line_table::range* line_table::find(line_t line) const
+{
+    auto it = std::ranges::find(_ranges, line, &range::line);
+    return it != _ranges.end() ? &(*it) : nullptr;
+}
+
+std::optional<line_table::line_t> line_table::snap(line_t line) const
+{
+    std::optional<line_t> nearest;
+    for (const auto& range : _ranges) {
+        if (range.line >= line && (!nearest || range.line < *nearest)) {
+            nearest = range.line;
+        }
+    }
+
+    return nearest;
+}
+
+line_table::line_t line_table::line_at(int lasti) const
+{
+    auto it = std::ranges::upper_bound(_ranges, lasti, {}, &range::start);
+    if (it == _ranges.begin()) {
+        return _first_line;
+    }
+
+    return std::prev(it)->line;
+}
+
+line_bitset line_table::nested_spans(PyCodeObject* code) const
+{
+    auto spans = line_bitset{ _first_line, _last_line };
+    const auto consts = code->co_consts;
+    for (int i = 0, n = PyTuple_GET_SIZE(consts); i < n; i++) {
+        auto item = PyTuple_GET_ITEM(consts, i);
+        if (!PyCode_Check(item)) {
+            continue;
+        }
+
+        const auto nested = line_table{ reinterpret_cast<PyCodeObject*>(item) };
+        for (auto line = nested.first_line(); line <= nested.last_line(); line++) {
+            spans.set(line);
+        }
+    }
+
+    return spans;
+}
@@ -0,0 +1,99 @@
+#pragma once
+#ifndef _BF2PY_LINE_TABLE_H_
+#define _BF2PY_LINE_TABLE_H_
+
+#include "breakpoint.h"
+#include "python.h"
+#include <bit>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+namespace bf2py {
+	// dense set of line numbers in [first, last]
+	class line_bitset {
+	public:
+		using line_t = Breakpoint::line_t;
+
+	private:
+		line_t _first = 0;
+		std::vector<std::uint64_t> _bits;
+
+	public:
+		line_bitset() = default;
+		line_bitset(line_t first, line_t last)
+			: _first(first), _bits(last >= first ? static_cast<std::size_t>(last - first) / 64 + 1 : 0)
+		{
+
+		}
+
+		bool set(line_t line)
+		{
+			const auto i = static_cast<std::uint64_t>(line - _first);
+			if (i >= _bits.size() * 64) {
+				return false;
+			}
+
+			_bits[i >> 6] |= std::uint64_t{ 1 } << (i & 63);
+			return true;
+		}
+
+		bool test(line_t line) const
+		{
+			// lines before _first wrap around and fail the size check
+			const auto i = static_cast<std::uint64_t>(line - _first);
+			return i < _bits.size() * 64 && (_bits[i >> 6] >> (i & 63)) & 1;
+		}
+
+		std::size_t count() const
+		{
+			std::size_t count = 0;
+			for (auto bits : _bits) {
+				count += std::popcount(bits);
+			}
+
+			return count;
+		}
+
+		bool any() const { return count() > 0; }
+	};
+
+	// executable lines of a code object and their bytecode ranges, decoded once from co_lnotab
+	class line_table {
+	public:
+		using line_t = Breakpoint::line_t;
+
+		struct range {
+			line_t line;
+			int start; // first bytecode offset of the line
+			int end; // one past the last bytecode offset
+		};
+
+	private:
+		std::vector<range> _ranges; // ordered by bytecode offset
+		line_t _first_line = 0;
+		line_t _last_line = 0;
+
+	public:
+		explicit line_table(PyCodeObject* code);
+
+		const auto& ranges() const { return _ranges; }
+		line_t first_line() const { return _first_line; }
+		line_t last_line() const { return _last_line; }
+
+		const range* find(line_t line) const;
+		bool executable(line_t line) const { return find(line) != nullptr; }
+
+		// the nearest executable line at or after line (within this code object)
+		std::optional<line_t> snap(line_t line) const;
+
+		// the line of the instruction at bytecode offset lasti (what the interpreter computes for f_lineno)
+		line_t line_at(int lasti) const;
+
+		// the line spans [co_firstlineno, last line] of all code objects nested in code (functions, classes, lambdas),
+		// code must be the code object this table was built from
+		line_bitset nested_spans(PyCodeObject* code) const;
+	};
+}
+
+#endif
@@ -1,10 +1,14 @@
 #define WIN32_LEAN_AND_MEAN
 #include <Windows.h>
 #include <detours/detours.h>
+#include <cstdlib>
 #include <type_traits>
 #include <print>
 #include <functional>
 #include <map>
+#include <ranges>
+#include <set>
+#include <string_view>
 #include "debugger.h"
 #include "output_redirect.h"
 
@@ -15,6 +19,7 @@ auto bf2_Py_InitModule4 = ::Py_InitModule4;
 auto bf2_PyEval_InitThreads = ::PyEval_InitThreads;
 auto bf2_Py_Finalize = ::Py_Finalize;
 bool forwardOutput = false;
+std::string watchGlobal; // +pyDebugWatch=<name>: data breakpoint on a global of __main__ (benchmarks)
 bf2py::debugger g_debug;
 bf2py::output_redirect g_stdout_redirect, g_stderr_redirect;
 
@@ -37,6 +42,14 @@ void output_callback(std::u8string msg) {
     }
 }
 
+std::string to_utf8(std::wstring_view wstr)
+{
+    auto len = ::WideCharToMultiByte(CP_UTF8, 0, wstr.data(), static_cast<int>(wstr.size()), nullptr, 0, nullptr, nullptr);
+    auto str = std::string(len, '\0');
+    ::WideCharToMultiByte(CP_UTF8, 0, wstr.data(), static_cast<int>(wstr.size()), str.data(), len, nullptr, nullptr);
+    return str;
+}
+
 BOOL __stdcall allocConsole()
 {
     // note: anything printed (print/cout/printf) until this point is not visible
@@ -157,7 +170,17 @@ void pyInitialize()
         return;
     }
 
-    g_debug.enable_trace();
+    // only installs the trace function if we wait for a client on entry,
+    // otherwise the interpreter runs untraced until a client needs it
+    g_debug.update_trace();
+
+    if (!watchGlobal.empty()) {
+        auto mainDict = PyModule_GetDict(PyImport_AddModule((char*)"__main__"));
+        bf2py::PyNewRef key = PyString_FromString(watchGlobal.c_str());
+        std::vector<DataBreakpoint> watches;
+        watches.emplace_back(watchGlobal, mainDict, key);
+        g_debug.set_data_breaks(std::move(watches));
+    }
 
     // after bf2 calls Py_Initialize() it sets the path variable to ['pylib-2.3.4.zip', 'python', 'mods/bf2/python', 'admin']
 	// any initializeation done here which depends on python modules need to do their own path initialization
@@ -165,6 +188,64 @@ void pyInitialize()
 }
 static_assert(std::is_same_v<decltype(bf2_Py_Initialize), decltype(&pyInitialize)>, "bf2 and pydebug Py_Initialize signature must match");
 
+// debug-test -benchmark switches between its scenarios with this (called on the python thread, no client attached):
+// "clear" removes all breakpoints and exception filters, "break=<file>|<line>[|<condition>]", "exceptions=never|unhandled|all"
+extern "C" int bf2pyBenchmarkConfigure(const char* option)
+{
+    static std::set<std::string> breakFiles;
+    const auto command = std::string_view{ option };
+    if (command == "clear") {
+        for (const auto& filename : breakFiles) {
+            g_debug.set_breaks(filename, {});
+        }
+
+        breakFiles.clear();
+        g_debug.set_exception_mode(bf2py::bdb::exception_mode::NEVER);
+        return 0;
+    }
+
+    if (command.starts_with("break=")) {
+        auto args = command.substr(std::size("break=") - 1);
+        const auto fileEnd = args.find('|');
+        if (fileEnd == std::string_view::npos) {
+            return -1;
+        }
+
+        const auto filename = std::string{ args.substr(0, fileEnd) };
+        args = args.substr(fileEnd + 1);
+        const auto lineEnd = args.find('|');
+        const auto line = std::strtoul(std::string{ args.substr(0, lineEnd) }.c_str(), nullptr, 10);
+        const auto condition = lineEnd == std::string_view::npos ? std::string{} : std::string{ args.substr(lineEnd + 1) };
+        if (line == 0) {
+            return -1;
+        }
+
+        breakFiles.insert(g_debug.canonic(filename));
+        g_debug.set_break(filename, line, false, condition);
+        return 0;
+    }
+
+    if (command.starts_with("exceptions=")) {
+        const auto mode = command.substr(std::size("exceptions=") - 1);
+        if (mode == "never") {
+            g_debug.set_exception_mode(bf2py::bdb::exception_mode::NEVER);
+        }
+        else if (mode == "unhandled") {
+            g_debug.set_exception_mode(bf2py::bdb::exception_mode::UNHANDLED_EXCEPTION);
+        }
+        else if (mode == "all") {
+            g_debug.set_exception_mode(bf2py::bdb::exception_mode::ALL_EXCEPTIONS);
+        }
+        else {
+            return -1;
+        }
+
+        return 0;
+    }
+
+    return -1;
+}
+
 PyCFunction bf2_logWrite = nullptr;
 PyObject* logWrite(PyObject* self, PyObject* args)
 {
@@ -212,6 +293,26 @@ static_assert(std::is_same_v<decltype(bf2_PyEval_InitThreads), decltype(&pyEval_
 void pyFinalize()
 {
     g_debug.stop();
+
+    auto& profiler = g_debug.profiler();
+    profiler.stop();
+    if (profiler.samples() > 0 && profiler.write("bf2py-profile.folded")) {
+        std::println("[debugger] wrote {} profiler samples to bf2py-profile.folded", profiler.samples());
+    }
+
+    if (!g_debug.coverage().codes().empty()) {
+        g_debug.coverage().write_lcov("bf2py-coverage.info");
+        g_debug.coverage().write_cobertura("bf2py-coverage.xml");
+        std::println("[debugger] wrote the line coverage of {} code objects to bf2py-coverage.info/.xml", g_debug.coverage().codes().size());
+    }
+
+    // the recorded tables reference code objects
+    profiler.clear();
+    g_debug.call_profiler().stop();
+    g_debug.call_profiler().clear();
+    g_debug.enable_coverage(false);
+    g_debug.coverage().clear();
+
     g_debug.disable_trace();
 
     bf2_Py_Finalize();
@@ -234,10 +335,95 @@ BOOL WINAPI DllMain(HINSTANCE hinst, DWORD dwReason, LPVOID reserved)
             g_debug.wait_for_connection(false);
         }
 
+        // only debug code matching these globs (separated by ';'), e.g. +pyDebugTraceScope=mods/bf2/python/game/*
+        if (auto pos = cmd.find(L"+pyDebugTraceScope="); pos != std::wstring::npos) {
+            auto globs = cmd.substr(pos + std::size(L"+pyDebugTraceScope=") - 1);
+            globs = globs.substr(0, globs.find(L' '));
+
+            std::vector<std::string> scope;
+            for (auto glob : std::views::split(globs, L';')) {
+                scope.push_back(to_utf8(std::wstring_view{ glob.begin(), glob.end() }));
+            }
+
+            g_debug.set_trace_scope(scope);
+        }
+
         if (cmd.contains(L"+pyDebugForwardOutput=1")) {
             forwardOutput = true;
         }
 
+        // marshal every trace event through the io thread (the pre-inline behavior, mostly useful for comparison)
+        if (cmd.contains(L"+pyDebugInlineTrace=0")) {
+            g_debug.mode(bf2py::debugger::trace_mode::IO_THREAD);
+        }
+
+        // virtual hook calls on every trace event (the pre-static dispatch behavior, mostly useful for comparison)
+        if (cmd.contains(L"+pyDebugStaticDispatch=0")) {
+            g_debug.static_dispatch(false);
+        }
+
+        // trace even without a client (e.g. to measure the tracing overhead with debug-test -benchmark)
+        if (cmd.contains(L"+pyDebugForceTrace=1")) {
+            g_debug.force_trace(true);
+        }
+
+        // breakpoints via patched code objects, the trace function is only installed while stepping
+        if (cmd.contains(L"+pyDebugEngine=patch")) {
+            g_debug.set_engine(bf2py::bdb::breakpoint_engine::CODE_PATCH);
+        }
+
+        if (auto pos = cmd.find(L"+pyDebugWatch="); pos != std::wstring::npos) {
+            auto name = cmd.substr(pos + std::size(L"+pyDebugWatch=") - 1);
+            name = name.substr(0, name.find(L' '));
+            watchGlobal = to_utf8(name);
+        }
+
+        // sample the python stacks at the given rate (in Hz) from the start, the result is written on Py_Finalize
+        if (auto pos = cmd.find(L"+pyDebugProfile="); pos != std::wstring::npos) {
+            auto rate = std::wcstoul(cmd.c_str() + pos + std::size("+pyDebugProfile=") - 1, nullptr, 10);
+            g_debug.profiler().start(rate > 0 ? rate : 1000);
+        }
+
+        // record the executed lines, written to bf2py-coverage.info (lcov) and bf2py-coverage.xml (cobertura) on Py_Finalize
+        if (cmd.contains(L"+pyDebugCoverage=1")) {
+            g_debug.enable_coverage(true);
+        }
+
+        // write a snapshot of the stack to <dir> when an exception isn't handled while no client is attached (see debug-test -replay)
+        if (auto pos = cmd.find(L"+pyDebugSnapshot="); pos != std::wstring::npos) {
+            auto dir = cmd.substr(pos + std::size(L"+pyDebugSnapshot=") - 1);
+            dir = dir.substr(0, dir.find(L' '));
+            g_debug.snapshot_dir(dir);
+        }
+
+        // bytes (KiB) queued for a slow client before output events are merged (or dropped with +pyDebugOutputOverflow=drop)
+        auto outputPolicy = cmd.contains(L"+pyDebugOutputOverflow=drop") ? bf2py::debugger_session::output_policy::DROP : bf2py::debugger_session::output_policy::MERGE;
+        auto writeLimit = std::size_t{ 1024 };
+        if (auto pos = cmd.find(L"+pyDebugWriteLimit="); pos != std::wstring::npos) {
+            writeLimit = std::wcstoul(cmd.c_str() + pos + std::size("+pyDebugWriteLimit=") - 1, nullptr, 10);
+        }
+
+        g_debug.write_queue((writeLimit > 0 ? writeLimit : 1024) * 1024, outputPolicy);
+
+        // output is sent in batches every <ms>, lines beyond <lines/s> are suppressed (0 = unlimited)
+        auto outputBatch = std::size_t{ 10 };
+        if (auto pos = cmd.find(L"+pyDebugOutputBatch="); pos != std::wstring::npos) {
+            outputBatch = std::wcstoul(cmd.c_str() + pos + std::size("+pyDebugOutputBatch=") - 1, nullptr, 10);
+        }
+
+        auto outputRate = std::size_t{ 1000 };
+        if (auto pos = cmd.find(L"+pyDebugOutputRate="); pos != std::wstring::npos) {
+            outputRate = std::wcstoul(cmd.c_str() + pos + std::size("+pyDebugOutputRate=") - 1, nullptr, 10);
+        }
+
+        g_debug.output_limit(std::chrono::milliseconds{ outputBatch }, static_cast<double>(outputRate));
+
+        // keep the last <events> trace events of every thread, written to bf2py-flight.log when an exception isn't handled
+        if (auto pos = cmd.find(L"+pyDebugFlightRecorder="); pos != std::wstring::npos) {
+            auto events = std::wcstoul(cmd.c_str() + pos + std::size("+pyDebugFlightRecorder=") - 1, nullptr, 10);
+            g_debug.enable_recorder(events > 0 ? events : 4096);
+        }
+
         g_debug.start();      
 
         DetourRestoreAfterWith();
@@ -0,0 +1,105 @@
+#include "output_batcher.h"
+#include <algorithm>
+#include <format>
+using namespace bf2py;
+
+output_batcher::output_batcher(std::size_t maxBatch, double rate, double burst)
+    : _max_batch(maxBatch)
+{
+    limit(rate, burst);
+}
+
+void output_batcher::limit(double rate, double burst)
+{
+    std::lock_guard lock{ _mutex };
+    _rate = std::max(rate, 0.0);
+    _burst = burst > 0 ? burst : _rate;
+    _tokens = _burst;
+    _refilled = clock::now();
+}
+
+output_batcher::flush_t output_batcher::append(std::string_view text)
+{
+    std::lock_guard lock{ _mutex };
+    const auto now = clock::now();
+    while (!text.empty()) {
+        const auto end = text.find('\n');
+        const auto line = text.substr(0, end == std::string_view::npos ? text.size() : end + 1);
+        text.remove_prefix(line.size());
+        add_line(line, now);
+    }
+
+    if (!_flush_now && _batch.size() >= _max_batch) {
+        _flush_now = true;
+        return flush_t::NOW;
+    }
+
+    if (!_scheduled && (!_batch.empty() || _repeats > 0 || _suppressed > 0)) {
+        _scheduled = true;
+        return flush_t::LATER;
+    }
+
+    return flush_t::NONE;
+}
+
+void output_batcher::add_line(std::string_view line, clock::time_point now)
+{
+    // repeats are only counted, they neither take space nor tokens
+    if (!_last.empty() && line == _last) {
+        _repeats++;
+        return;
+    }
+
+    add_repeats();
+
+    if (_rate > 0) {
+        _tokens = std::min(_burst, _tokens + std::chrono::duration<double>(now - _refilled).count() * _rate);
+        _refilled = now;
+        if (_tokens < 1) {
+            _suppressed++;
+            _last.clear();
+            return;
+        }
+
+        _tokens -= 1;
+    }
+
+    _batch += line;
+    _last = line;
+}
+
+void output_batcher::add_repeats()
+{
+    if (_repeats == 0) {
+        return;
+    }
+
+    // "line (Nx)": the line above was repeated N more times, _last is kept so the next repeats keep collapsing
+    const auto newline = _last.ends_with('\n');
+    _batch.append(_last, 0, _last.size() - newline);
+    _batch += std::format(" ({}x)", _repeats);
+    if (newline) {
+        _batch += '\n';
+    }
+
+    _repeats = 0;
+}
+
+bool output_batcher::take(std::string& output)
+{
+    std::lock_guard lock{ _mutex };
+    add_repeats();
+
+    // at most one summary per second while lines are suppressed
+    const auto now = clock::now();
+    if (_suppressed > 0 && now - _reported >= std::chrono::seconds{ 1 }) {
+        _batch += std::format("[bf2py] {} lines suppressed (more than {} lines/s)\n", _suppressed, _rate);
+        _suppressed = 0;
+        _reported = now;
+    }
+
+    output.swap(_batch);
+    _flush_now = false;
+    _scheduled = _suppressed > 0;
+    return _scheduled;
+}
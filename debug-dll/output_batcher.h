@@ -0,0 +1,59 @@
+#pragma once
+#ifndef _BF2PY_OUTPUT_BATCHER_H_
+#define _BF2PY_OUTPUT_BATCHER_H_
+
+#include <chrono>
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+namespace bf2py {
+	// collects the output of all threads (redirected stdout/stderr, host.log, logpoints) into batches which are sent as one output event:
+	// identical consecutive lines collapse into "line (Nx)", lines beyond a token bucket (lines/s) are suppressed and summarized
+	// Note: doesn't depend on asio or python, the owner decides when to take() (see debugger::log)
+	class output_batcher {
+	public:
+		using clock = std::chrono::steady_clock;
+
+		// what the owner has to do after append
+		enum class flush_t : unsigned char {
+			NONE, // already scheduled
+			LATER, // the first output of a batch, take() after the batch interval
+			NOW // the batch reached its size limit
+		};
+
+	private:
+		std::mutex _mutex;
+		std::size_t _max_batch;
+		double _rate; // lines/s, 0 = unlimited
+		double _burst;
+		double _tokens;
+		clock::time_point _refilled = clock::now();
+
+		std::string _batch;
+		std::string _last; // the last line in the batch (including '\n'), empty if it was suppressed
+		std::size_t _repeats = 0; // _last repeated since it was added
+		std::size_t _suppressed = 0;
+		clock::time_point _reported{};
+		bool _scheduled = false;
+		bool _flush_now = false;
+
+		void add_line(std::string_view line, clock::time_point now);
+		void add_repeats();
+
+	public:
+		explicit output_batcher(std::size_t maxBatch = 16 * 1024, double rate = 0, double burst = 0);
+
+		// rate in lines/s (0 = unlimited), burst lines may be sent at once (defaults to one second worth of lines)
+		void limit(double rate, double burst = 0);
+
+		// any thread, text may contain several lines
+		flush_t append(std::string_view text);
+		// swaps the batch into output (an empty string whose capacity is reused),
+		// true if suppressed lines still have to be reported by another take()
+		bool take(std::string& output);
+	};
+}
+
+#endif
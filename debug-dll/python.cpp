@@ -94,6 +94,36 @@ std::string py_utils::dis(PyCodeObject* co, int lasti)
 	return "Failed to dissassemble bytecode - sys.path might not yet be initialized";
 }
 
+std::expected<PyObject*, std::string> py_utils::compile(const std::string& source, const char* filename, int start)
+{
+	auto code = Py_CompileString(source.c_str(), const_cast<char*>(filename), start);
+	if (!code) {
+		return std::unexpected(fetch_error());
+	}
+
+	return code;
+}
+
+std::string py_utils::fetch_error()
+{
+	PyObject* type, * value, * traceback;
+	PyErr_Fetch(&type, &value, &traceback);
+	PyNewRef _type = type, _value = value, _traceback = traceback;
+	if (!type) {
+		return "unknown error";
+	}
+
+	PyNewRef typeStr = PyObject_Str(type);
+	PyNewRef valueStr = value ? PyObject_Str(value) : nullptr;
+	PyErr_Clear();
+
+	if (typeStr && valueStr) {
+		return std::format("{}: {}", PyString_AsString(typeStr), PyString_AsString(valueStr));
+	}
+
+	return typeStr ? PyString_AsString(typeStr) : "unknown error";
+}
+
 bool py_utils::init()
 {
 	PyNewRef strIOModule = PyImport_ImportModule((char*)"StringIO");
@@ -40,15 +40,16 @@
 namespace bf2py {
 	class PyNewRef {
 		struct PyDelete {
-			void operator()(PyObject* ptr) { Py_DECREF(ptr); }
+			// references might outlive the interpreter (e.g. owned by the global debugger)
+			void operator()(PyObject* ptr) { if (Py_IsInitialized()) Py_DECREF(ptr); }
 		};
 		std::unique_ptr<PyObject, PyDelete> _ptr;
 
 	public:
 		PyNewRef(PyObject* ptr = nullptr) : _ptr(ptr) {}
 		PyNewRef& operator=(PyObject* ptr) { _ptr.reset(ptr); return *this; }
-		operator bool() { return _ptr.operator bool(); }
-		operator PyObject* () { return _ptr.get(); }
+		operator bool() const { return _ptr.operator bool(); }
+		operator PyObject* () const { return _ptr.get(); }
 	};
 
 	struct py_call_result {
@@ -60,6 +61,8 @@ namespace bf2py {
 	struct py_utils {
 		static std::expected<py_call_result, std::u8string> call(std::function<PyObject* ()> callback);
 		static std::string dis(PyCodeObject* co, int lasti = -1);
+		static std::expected<PyObject*, std::string> compile(const std::string& source, const char* filename, int start);
+		static std::string fetch_error();
 		static bool init();
 	};
 }
@@ -0,0 +1,174 @@
+#include "sampling_profiler.h"
+#include <algorithm>
+#include <format>
+#include <fstream>
+#include <print>
+using namespace bf2py;
+
+sampling_profiler::sampling_profiler(asio::io_context& ctx)
+    : _timer(ctx)
+{
+
+}
+
+void sampling_profiler::start(unsigned int rate)
+{
+    _interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::seconds(1)) / std::max(rate, 1u);
+    if (_running) {
+        return;
+    }
+
+    _running = true;
+    schedule(std::chrono::steady_clock::now() + _interval);
+}
+
+void sampling_profiler::stop()
+{
+    _running = false;
+    _timer.cancel();
+}
+
+void sampling_profiler::clear()
+{
+    std::lock_guard lock{ _mutex };
+    _ids.clear();
+    _refs.clear();
+    _codes.clear();
+    _stacks.clear();
+    _samples = 0;
+}
+
+std::size_t sampling_profiler::samples() const
+{
+    std::lock_guard lock{ _mutex };
+    return _samples;
+}
+
+void sampling_profiler::schedule(std::chrono::steady_clock::time_point next)
+{
+    _timer.expires_at(next);
+    _timer.async_wait([this, next](const std::error_code& error) {
+        if (error || !_running) {
+            return;
+        }
+
+        sample();
+
+        // keep the rate stable, but don't try to catch up after a stall
+        const auto now = std::chrono::steady_clock::now();
+        schedule(std::max(next + _interval, now));
+    });
+}
+
+void sampling_profiler::sample()
+{
+    if (!Py_IsInitialized() || (_paused && _paused())) {
+        return;
+    }
+
+    // the python threads wait for the GIL meanwhile, so their frames don't change while they are walked
+    // (taken before _mutex, like clear() which is called with the GIL held)
+    const auto gil = PyGILState_Ensure();
+    const auto self = PyThreadState_Get();
+    std::unique_lock lock{ _mutex };
+
+    std::vector<std::uint32_t> stack;
+    for (auto interpreter = PyInterpreterState_Head(); interpreter; interpreter = PyInterpreterState_Next(interpreter)) {
+        for (auto thread = PyInterpreterState_ThreadHead(interpreter); thread; thread = PyThreadState_Next(thread)) {
+            auto frame = thread->frame;
+            if (thread == self) {
+                // the io thread's own state (created by PyGILState_Ensure)
+                continue;
+            }
+
+            if (!frame) {
+                // not running python code (e.g. bf2 itself or sleeping)
+                continue;
+            }
+
+            stack.clear();
+            for (; frame && stack.size() < 256; frame = frame->f_back) {
+                auto code = frame->f_code;
+                if (!code || !PyCode_Check(code)) {
+                    break;
+                }
+
+                stack.push_back(code_id(code));
+            }
+
+            if (stack.empty()) {
+                continue;
+            }
+
+            // the top of the stack is self time, recursion counts once for the total
+            _codes[stack.front()].self++;
+            for (std::size_t i = 0; i < stack.size(); i++) {
+                if (std::find(stack.begin(), stack.begin() + i, stack[i]) == stack.begin() + i) {
+                    _codes[stack[i]].total++;
+                }
+            }
+
+            std::reverse(stack.begin(), stack.end());
+            _stacks[{ thread->thread_id, stack }]++;
+            _samples++;
+        }
+    }
+
+    lock.unlock();
+    PyGILState_Release(gil);
+}
+
+std::uint32_t sampling_profiler::code_id(PyCodeObject* code)
+{
+    auto it = _ids.find(code);
+    if (it != _ids.end()) {
+        return it->second;
+    }
+
+    const auto id = static_cast<std::uint32_t>(_codes.size());
+    _codes.push_back({
+        .name = std::format("{} ({}:{})", PyString_AS_STRING(code->co_name), PyString_AS_STRING(code->co_filename), code->co_firstlineno)
+    });
+    _ids.emplace(code, id);
+    Py_INCREF(code);
+    _refs.emplace_back(reinterpret_cast<PyObject*>(code));
+    return id;
+}
+
+std::vector<sampling_profiler::code_info> sampling_profiler::functions() const
+{
+    std::lock_guard lock{ _mutex };
+    auto result = _codes;
+    std::ranges::sort(result, std::greater{}, &code_info::self);
+    return result;
+}
+
+std::string sampling_profiler::folded() const
+{
+    std::lock_guard lock{ _mutex };
+    std::string result;
+    for (const auto& [key, count] : _stacks) {
+        const auto& [thread, stack] = key;
+        result += std::format("thread {}", thread);
+        for (auto id : stack) {
+            result += ';';
+            result += _codes[id].name;
+        }
+
+        result += std::format(" {}\n", count);
+    }
+
+    return result;
+}
+
+bool sampling_profiler::write(const std::filesystem::path& path) const
+{
+    auto file = std::ofstream{ path, std::ios::binary };
+    if (!file) {
+        std::println(stderr, "[profiler] failed to open {}", path.string());
+        return false;
+    }
+
+    file << folded();
+    return file.good();
+}
@@ -0,0 +1,71 @@
+#pragma once
+#ifndef _BF2PY_SAMPLING_PROFILER_H_
+#define _BF2PY_SAMPLING_PROFILER_H_
+
+#include "asio.h"
+#include "python.h"
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace bf2py {
+	// samples the python stacks of all threads from the io thread (no trace function involved), taking the GIL for every sample,
+	// and aggregates them per code object and as folded stacks (for flamegraph.pl / speedscope)
+	class sampling_profiler {
+	public:
+		struct code_info {
+			std::string name;
+			std::size_t self = 0; // samples with this code object on top of the stack
+			std::size_t total = 0; // samples with this code object anywhere on the stack
+		};
+
+	private:
+
+		asio::steady_timer _timer;
+		std::chrono::steady_clock::duration _interval{};
+		bool _running = false;
+		std::function<bool()> _paused;
+
+		mutable std::mutex _mutex;
+		std::unordered_map<PyCodeObject*, std::uint32_t> _ids;
+		std::vector<PyNewRef> _refs; // the code objects of _ids, so that their addresses aren't reused by other code objects
+		std::vector<code_info> _codes;
+		std::map<std::pair<long, std::vector<std::uint32_t>>, std::size_t> _stacks; // code ids root first
+		std::size_t _samples = 0;
+
+	public:
+		explicit sampling_profiler(asio::io_context& ctx);
+
+		// skip samples while paused returns true (e.g. while the debugger is stopped),
+		// it must be true whenever the io thread runs on behalf of a python thread holding the GIL
+		void paused(std::function<bool()> paused) { _paused = std::move(paused); }
+
+		void start(unsigned int rate);
+		void stop();
+		// releases the code objects (GIL)
+		void clear();
+		bool running() const { return _running; }
+		std::size_t samples() const;
+
+		// sorted by self samples
+		std::vector<code_info> functions() const;
+
+		// one line per unique stack: "thread;frame;...;frame count"
+		std::string folded() const;
+		bool write(const std::filesystem::path& path) const;
+
+	private:
+		void schedule(std::chrono::steady_clock::time_point next);
+		void sample();
+		std::uint32_t code_id(PyCodeObject* code);
+	};
+}
+
+#endif
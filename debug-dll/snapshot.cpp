@@ -0,0 +1,180 @@
+#include "snapshot.h"
+#include <array>
+#include <format>
+#include <fstream>
+#include <print>
+#include <string_view>
+#include <type_traits>
+using namespace bf2py;
+
+namespace {
+    // file layout: magic, version, then the snapshot's members in declaration order,
+    // integers in native (little endian) byte order, strings and vectors prefixed by their u32 size
+    constexpr std::string_view magic = "BF2PYSNP";
+    constexpr std::uint32_t version = 1;
+
+    // nested variables are bounded by the capture depth, but a corrupted file must not recurse forever
+    constexpr std::size_t max_depth = 64;
+
+    class writer {
+        std::ofstream& _file;
+
+    public:
+        explicit writer(std::ofstream& file) : _file(file) {}
+
+        template<typename T>
+        void put(T value) requires std::is_integral_v<T>
+        {
+            _file.write(reinterpret_cast<const char*>(&value), sizeof(value));
+        }
+
+        void put(const std::string& str)
+        {
+            put(static_cast<std::uint32_t>(str.size()));
+            _file.write(str.data(), str.size());
+        }
+
+        void put(const std::vector<snapshot::variable>& variables)
+        {
+            put(static_cast<std::uint32_t>(variables.size()));
+            for (const auto& variable : variables) {
+                put(variable.name);
+                put(variable.type);
+                put(variable.value);
+                put(variable.children);
+            }
+        }
+    };
+
+    class reader {
+        std::ifstream& _file;
+        std::streamoff _end = 0;
+
+        // what is left of the file, a corrupt size must not be allocated
+        std::streamoff remaining()
+        {
+            const auto pos = _file.tellg();
+            return pos < 0 ? 0 : _end - static_cast<std::streamoff>(pos);
+        }
+
+    public:
+        explicit reader(std::ifstream& file) : _file(file)
+        {
+            const auto pos = _file.tellg();
+            _file.seekg(0, std::ios::end);
+            _end = _file.tellg();
+            _file.seekg(pos);
+        }
+
+        template<typename T>
+        bool get(T& value) requires std::is_integral_v<T>
+        {
+            return !!_file.read(reinterpret_cast<char*>(&value), sizeof(value));
+        }
+
+        bool get(std::string& str)
+        {
+            std::uint32_t size = 0;
+            if (!get(size) || size > remaining()) {
+                return false;
+            }
+
+            str.resize(size);
+            return !!_file.read(str.data(), size);
+        }
+
+        bool get(std::vector<snapshot::variable>& variables, std::size_t depth = 0)
+        {
+            std::uint32_t count = 0;
+            if (depth > max_depth || !get(count)) {
+                return false;
+            }
+
+            variables.clear();
+            for (std::uint32_t i = 0; i < count; i++) {
+                auto& variable = variables.emplace_back();
+                if (!get(variable.name) || !get(variable.type) || !get(variable.value) || !get(variable.children, depth + 1)) {
+                    return false;
+                }
+            }
+
+            return true;
+        }
+    };
+}
+
+bool snapshot::write(const std::filesystem::path& path) const
+{
+    auto file = std::ofstream{ path, std::ios::binary };
+    if (!file) {
+        std::println(stderr, "[snapshot] failed to open {}", path.string());
+        return false;
+    }
+
+    auto out = writer{ file };
+    file.write(magic.data(), magic.size());
+    out.put(version);
+    out.put(thread);
+    out.put(time);
+    out.put(exception);
+
+    out.put(static_cast<std::uint32_t>(frames.size()));
+    for (const auto& frame : frames) {
+        out.put(frame.filename);
+        out.put(frame.function);
+        out.put(frame.line);
+        out.put(frame.locals);
+        out.put(frame.globals);
+    }
+
+    out.put(static_cast<std::uint32_t>(globals.size()));
+    for (const auto& variables : globals) {
+        out.put(variables);
+    }
+
+    return !!file;
+}
+
+std::expected<snapshot, std::string> snapshot::read(const std::filesystem::path& path)
+{
+    auto file = std::ifstream{ path, std::ios::binary };
+    if (!file) {
+        return std::unexpected(std::format("failed to open {}", path.string()));
+    }
+
+    auto header = std::array<char, magic.size()>{};
+    std::uint32_t fileVersion = 0;
+    if (!file.read(header.data(), header.size()) || std::string_view{ header.data(), header.size() } != magic) {
+        return std::unexpected(std::format("{} is not a snapshot", path.string()));
+    }
+
+    auto in = reader{ file };
+    if (!in.get(fileVersion) || fileVersion != version) {
+        return std::unexpected(std::format("unsupported snapshot version {}", fileVersion));
+    }
+
+    auto result = snapshot{};
+    std::uint32_t count = 0;
+    auto ok = in.get(result.thread) && in.get(result.time) && in.get(result.exception) && in.get(count);
+    for (std::uint32_t i = 0; ok && i < count; i++) {
+        auto& frame = result.frames.emplace_back();
+        ok = in.get(frame.filename) && in.get(frame.function) && in.get(frame.line) && in.get(frame.locals) && in.get(frame.globals);
+    }
+
+    ok = ok && in.get(count);
+    for (std::uint32_t i = 0; ok && i < count; i++) {
+        ok = in.get(result.globals.emplace_back());
+    }
+
+    if (!ok) {
+        return std::unexpected(std::format("{} is truncated", path.string()));
+    }
+
+    for (const auto& frame : result.frames) {
+        if (frame.globals >= result.globals.size()) {
+            return std::unexpected(std::format("{} is corrupted", path.string()));
+        }
+    }
+
+    return result;
+}
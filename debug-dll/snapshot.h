@@ -0,0 +1,42 @@
+#pragma once
+#ifndef _BF2PY_SNAPSHOT_H_
+#define _BF2PY_SNAPSHOT_H_
+
+#include <cstdint>
+#include <expected>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+namespace bf2py {
+	// the stack of an unhandled exception with bounded-depth reprs of the variables,
+	// written by the debugger when no client is attached and served by debug-test -replay
+	// Note: doesn't depend on python, so the reader can be used without an interpreter
+	struct snapshot {
+		struct variable {
+			std::string name;
+			std::string type;
+			std::string value; // repr, truncated
+			std::vector<variable> children; // items/attributes, empty once the depth limit is reached
+		};
+
+		struct frame {
+			std::string filename;
+			std::string function;
+			std::uint32_t line = 0;
+			std::vector<variable> locals;
+			std::uint32_t globals = 0; // index into snapshot::globals (the frames of a module share their globals)
+		};
+
+		std::uint32_t thread = 0;
+		std::int64_t time = 0; // seconds since the epoch
+		std::string exception;
+		std::vector<frame> frames; // innermost first
+		std::vector<std::vector<variable>> globals;
+
+		bool write(const std::filesystem::path& path) const;
+		static std::expected<snapshot, std::string> read(const std::filesystem::path& path);
+	};
+}
+
+#endif
@@ -1,13 +1,16 @@
 #include "bf2simulator.h"
 #include "python.h"
+#include "trace_benchmark.h"
 #include <thread>
 #include <type_traits>
 #ifdef _WIN32
 #include <Windows.h>
 #endif
 #include <print>
+#include <fstream>
 #include <iostream>
 #include <memory>
+#include <nlohmann/json.hpp>
 using namespace bf2py;
 PyMethodDef host_methods[];
 
@@ -37,8 +40,32 @@ public:
 	}
 
 	operator bool() const { return _ptr != nullptr; }
+
+	void* symbol(const char* name) const
+	{
+#ifdef _WIN32
+		return _ptr ? reinterpret_cast<void*>(::GetProcAddress(_ptr, name)) : nullptr;
+#else
+		return nullptr;
+#endif
+	}
 };
 
+namespace {
+	bool load_dlls(const std::vector<std::string>& paths, std::vector<DynLib>& dlls)
+	{
+		for (const auto& path : paths) {
+			dlls.emplace_back(path.c_str());
+			if (!dlls.back()) {
+				std::println("Failed to load dll '{}', error: {}", path, GetLastError());
+				return false;
+			}
+		}
+
+		return true;
+	}
+}
+
 void bf2simulator::stop()
 {
 	_running = false;
@@ -53,12 +80,8 @@ int bf2simulator::run(const std::string& mod, const std::string& adminScript)
 	_running = true;
 
 	std::vector<DynLib> dlls;
-	for (const auto& path : _dlls) {
-		dlls.emplace_back(path.c_str());
-		if (!dlls.back()) {
-			std::println("Failed to load dll '{}', error: {}", path, GetLastError());
-			return 1;
-		}
+	if (!load_dlls(_dlls, dlls)) {
+		return 1;
 	}
 
 #ifdef _WIN32
@@ -184,6 +207,76 @@ int bf2simulator::run(const std::string& mod, const std::string& adminScript)
 	return 0;
 }
 
+int bf2simulator::benchmark(std::size_t iterations)
+{
+	std::vector<DynLib> dlls;
+	if (!load_dlls(_dlls, dlls)) {
+		return 1;
+	}
+
+	// the injected debugger installs its trace function in Py_Initialize
+	Py_NoSiteFlag = 1;
+	Py_Initialize();
+	struct _finalizer {
+		~_finalizer() {
+			if (PyErr_Occurred()) {
+				PyErr_Print();
+			}
+
+			Py_Finalize();
+		}
+	} finalizer;
+
+	// the injected debugger exports a function to switch between the scenarios (breakpoints, exception filters)
+	trace_benchmark::configure_t configure;
+	for (const auto& dll : dlls) {
+		if (auto func = reinterpret_cast<int(*)(const char*)>(dll.symbol("bf2pyBenchmarkConfigure"))) {
+			configure = func;
+		}
+	}
+
+	if (!configure) {
+		std::println("bf2pyBenchmarkConfigure not exported by the loaded dlls, only measuring the installed trace function");
+	}
+
+	auto results = trace_benchmark{ iterations, configure }.run();
+	if (!results) {
+		std::println("benchmark failed: {}", results.error());
+		return 1;
+	}
+
+	auto report = nlohmann::json::array();
+	std::println("{:<12} {:<24} {:>10} {:>12} {:>10}", "workload", "scenario", "events", "ns/event", "slowdown");
+	for (const auto& result : *results) {
+		std::println("{:<12} {:<24} {:>10} {:>12.1f} {:>10}", result.workload, "untraced", result.events, result.untraced_ns, "");
+		auto scenarios = nlohmann::json::array();
+		for (const auto& scenario : result.traced) {
+			const auto slowdown = result.untraced_ns > 0 ? scenario.ns / result.untraced_ns : 0;
+			std::println("{:<12} {:<24} {:>10} {:>12.1f} {:>9.1f}x", "", scenario.name, "", scenario.ns, slowdown);
+			scenarios.push_back({ { "name", scenario.name }, { "ns_per_event", scenario.ns }, { "slowdown", slowdown } });
+		}
+
+		report.push_back({
+			{ "workload", result.workload },
+			{ "events", result.events },
+			{ "untraced_ns_per_event", result.untraced_ns },
+			{ "scenarios", scenarios }
+		});
+	}
+
+	// machine readable, to compare runs (e.g. before and after a change of the trace function)
+	constexpr auto reportPath = "bf2py-benchmark.json";
+	if (auto file = std::ofstream{ reportPath }) {
+		file << report.dump(2) << '\n';
+		std::println("results written to {}", reportPath);
+	}
+	else {
+		std::println("failed to write {}", reportPath);
+	}
+
+	return 0;
+}
+
 PyObject* log_write(PyObject* self, PyObject* args)
 {
 	auto item = PyTuple_GetItem(args, 0);
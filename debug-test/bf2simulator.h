@@ -2,6 +2,7 @@
 #ifndef _BF2PY_SIM_H_
 #define _BF2PY_SIM_H_
 
+#include <cstddef>
 #include <vector>
 #include <string>
 
@@ -15,6 +16,7 @@ namespace bf2py {
 		void dlls(const std::vector<std::string>& dlls) { _dlls = dlls; }
 
 		int run(const std::string& mod = "bf2", const std::string& adminScript = "default");
+		int benchmark(std::size_t iterations);
 		void stop();
 
 	private:
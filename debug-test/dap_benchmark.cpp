@@ -0,0 +1,167 @@
+#include "dap_benchmark.h"
+#include "../debug-dll/dap_parser.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <format>
+#include <nlohmann/json.hpp>
+#include <random>
+#include <span>
+#include <string_view>
+#include <vector>
+using namespace bf2py;
+
+namespace {
+	// what a client sends while stepping through a stop (the json delimiter allows )" in the strings)
+	const char* requests[] = {
+		R"json({"command":"threads","type":"request","seq":1})json",
+		R"json({"command":"stackTrace","arguments":{"threadId":1234,"startFrame":0,"levels":20},"type":"request","seq":2})json",
+		R"json({"command":"scopes","arguments":{"frameId":1},"type":"request","seq":3})json",
+		R"json({"command":"variables","arguments":{"variablesReference":17},"type":"request","seq":4})json",
+		R"json({"command":"evaluate","arguments":{"expression":"game.realityserver.players[0].getName()","frameId":1,"context":"hover"},"type":"request","seq":5})json",
+		R"json({"command":"setBreakpoints","arguments":{"source":{"name":"gamemode.py","path":"c:\\bf2\\mods\\bf2\\python\\game\\gamemodes\\gamemode.py"},"lines":[12,40,88],"breakpoints":[{"line":12},{"line":40,"condition":"player.isAlive()"},{"line":88}],"sourceModified":false},"type":"request","seq":6})json",
+		R"json({"command":"next","arguments":{"threadId":1234},"type":"request","seq":7})json"
+	};
+
+	std::string frame(std::string_view body, std::string_view header = "Content-Length: {}\r\n\r\n")
+	{
+		const auto size = body.size();
+		return std::vformat(header, std::make_format_args(size)) + std::string{ body };
+	}
+
+	// reads stream in chunks of readSize (or random sizes with rng), every message is passed to handler
+	template<typename Handler>
+	std::expected<void, std::string> feed(dap_parser& parser, std::string_view stream, std::size_t readSize, std::mt19937* rng, Handler&& handler)
+	{
+		std::size_t offset = 0;
+		while (true) {
+			const auto message = parser.next();
+			if (!message) {
+				return std::unexpected(message.error());
+			}
+
+			if (*message) {
+				handler(**message);
+				continue;
+			}
+
+			if (offset == stream.size()) {
+				return {};
+			}
+
+			const auto space = parser.prepare(rng ? 1 + (*rng)() % readSize : readSize);
+			const auto chunk = std::min({ space.size(), stream.size() - offset, rng ? 1 + (*rng)() % readSize : readSize });
+			std::memcpy(space.data(), stream.data() + offset, chunk);
+			parser.commit(chunk);
+			offset += chunk;
+		}
+	}
+}
+
+std::expected<dap_benchmark_result, std::string> dap_benchmark::run()
+{
+	std::string stream;
+	for (std::size_t i = 0; i < _messages; i++) {
+		stream += frame(requests[i % std::size(requests)]);
+	}
+
+	// the best of a few runs, the others are disturbed by the rest of the system
+	auto measure = [&](bool parseJson) -> std::expected<double, std::string> {
+		auto best = std::chrono::duration<double>::max();
+		for (int repetition = 0; repetition < 3; repetition++) {
+			std::size_t parsed = 0;
+			auto parser = dap_parser{};
+			const auto start = std::chrono::steady_clock::now();
+			auto result = feed(parser, stream, _read_size, nullptr, [&](std::string_view body) {
+				parsed += !parseJson || !nlohmann::json::parse(body, nullptr, false).is_discarded();
+			});
+			const auto end = std::chrono::steady_clock::now();
+			if (!result) {
+				return std::unexpected(result.error());
+			}
+
+			if (parsed != _messages) {
+				return std::unexpected(std::format("parsed {} of {} messages", parsed, _messages));
+			}
+
+			best = std::min<std::chrono::duration<double>>(best, end - start);
+		}
+
+		return best.count();
+	};
+
+	const auto framing = measure(false);
+	const auto total = measure(true);
+	if (!framing || !total) {
+		return std::unexpected(!framing ? framing.error() : total.error());
+	}
+
+	const auto mb = stream.size() / (1024.0 * 1024.0);
+	return dap_benchmark_result{
+		.messages = _messages,
+		.bytes = stream.size(),
+		.framing_mb_per_s = mb / *framing,
+		.mb_per_s = mb / *total,
+		.ns_per_message = *total * 1e9 / _messages
+	};
+}
+
+std::expected<void, std::string> dap_fuzzer::run()
+{
+	constexpr std::string_view headers[] = {
+		"Content-Length: {}\r\n\r\n",
+		"content-length:{}\r\n\r\n",
+		"Content-Length: {}\r\nContent-Type: application/vscode-jsonrpc; charset=utf-8\r\n\r\n",
+		"Content-Type: application/vscode-jsonrpc\r\nCONTENT-LENGTH:   {}  \r\n\r\n"
+	};
+
+	auto rng = std::mt19937{ _seed };
+	for (std::size_t iteration = 0; iteration < _iterations; iteration++) {
+		// bodies may contain anything, including "\r\n\r\n" and headers
+		std::vector<std::string> bodies;
+		std::string stream;
+		const auto count = 1 + rng() % 16;
+		for (std::size_t i = 0; i < count; i++) {
+			auto& body = bodies.emplace_back(1 + rng() % 512, '\0');
+			std::ranges::generate(body, [&] { return "{}\r\n: Content-Length9x"[rng() % 22]; });
+			stream += frame(body, headers[rng() % std::size(headers)]);
+		}
+
+		std::size_t received = 0;
+		bool intact = true;
+		auto parser = dap_parser{ 1 + rng() % 256 };
+		auto result = feed(parser, stream, 1 + rng() % 1024, &rng, [&](std::string_view body) {
+			intact = intact && received < bodies.size() && body == bodies[received];
+			received++;
+		});
+
+		if (!result || !intact || received != bodies.size()) {
+			return std::unexpected(std::format("seed {}, iteration {}: a valid stream was split into {} of {} messages ({})",
+				_seed, iteration, received, bodies.size(), result ? "ok" : result.error()));
+		}
+
+		// corrupted: only has to terminate without crashing, every message must be within the received data
+		for (auto mutations = 1 + rng() % 8; mutations > 0 && !stream.empty(); mutations--) {
+			const auto pos = rng() % stream.size();
+			switch (rng() % 3) {
+			case 0: stream[pos] = static_cast<char>(rng()); break;
+			case 1: stream.erase(pos, 1 + rng() % 16); break;
+			case 2: stream.insert(pos, std::string(1 + rng() % 16, "\r\n:0"[rng() % 4])); break;
+			}
+		}
+
+		parser = dap_parser{ 1 + rng() % 256 };
+		std::size_t messages = 0;
+		bool bounded = true;
+		feed(parser, stream, 1 + rng() % 1024, &rng, [&](std::string_view body) {
+			bounded = bounded && !body.empty() && body.size() <= stream.size();
+			messages++;
+		});
+
+		if (!bounded || messages > stream.size()) {
+			return std::unexpected(std::format("seed {}, iteration {}: {} messages in {} bytes", _seed, iteration, messages, stream.size()));
+		}
+	}
+
+	return {};
+}
@@ -0,0 +1,44 @@
+#pragma once
+#ifndef _BF2PY_DAP_BENCHMARK_H_
+#define _BF2PY_DAP_BENCHMARK_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <expected>
+#include <string>
+
+namespace bf2py {
+	struct dap_benchmark_result {
+		std::size_t messages = 0;
+		std::size_t bytes = 0;
+		double framing_mb_per_s = 0; // only splitting the stream
+		double mb_per_s = 0; // including json::parse of every message
+		double ns_per_message = 0;
+	};
+
+	// measures the throughput of the dap_parser (framing and json parsing) on a stream of typical requests,
+	// received in chunks of read_size bytes (like the socket reads of debugger_session::run)
+	class dap_benchmark {
+		std::size_t _messages;
+		std::size_t _read_size;
+
+	public:
+		dap_benchmark(std::size_t messages, std::size_t readSize = 64 * 1024) : _messages(messages), _read_size(readSize) {}
+
+		std::expected<dap_benchmark_result, std::string> run();
+	};
+
+	// feeds mutated and arbitrarily split DAP streams to the dap_parser:
+	// valid streams must produce the same messages however they are split, corrupted ones must be rejected (and never crash)
+	class dap_fuzzer {
+		std::size_t _iterations;
+		std::uint32_t _seed;
+
+	public:
+		dap_fuzzer(std::size_t iterations, std::uint32_t seed) : _iterations(iterations), _seed(seed) {}
+
+		std::expected<void, std::string> run();
+	};
+}
+
+#endif
@@ -1,6 +1,11 @@
 #include "bf2simulator.h"
+#include "dap_benchmark.h"
+#include "replay_server.h"
 #include <csignal>
 #include <memory>
+#include <print>
+#include <random>
+#include <string>
 
 bf2py::bf2simulator simulator;
 void signal_handler(int signum) {
@@ -9,16 +14,90 @@ void signal_handler(int signum) {
 
 int main(int argc, char* argv[]) {
 	std::vector<std::string> dlls;
+	std::size_t benchmarkIterations = 0;
+	std::string replaySnapshot;
+	unsigned long replayPort = 5678;
+	std::size_t dapMessages = 0;
+	std::size_t dapFuzzIterations = 0;
+	auto dapFuzzSeed = std::random_device{}();
 	for (int i = 1; i < argc; i++) {
 		auto arg = std::string{ argv[i] };
 		if (arg.starts_with("-inject=")) {
 			dlls.push_back(arg.substr(8));
 		}
+		else if (arg == "-benchmark") {
+			benchmarkIterations = 1'000'000;
+		}
+		else if (arg.starts_with("-benchmark=")) {
+			benchmarkIterations = std::stoul(arg.substr(11));
+		}
+		else if (arg.starts_with("-replay=")) {
+			replaySnapshot = arg.substr(8);
+		}
+		else if (arg.starts_with("-port=")) {
+			replayPort = std::stoul(arg.substr(6));
+		}
+		else if (arg == "-dapBenchmark") {
+			dapMessages = 1'000'000;
+		}
+		else if (arg.starts_with("-dapBenchmark=")) {
+			dapMessages = std::stoul(arg.substr(14));
+		}
+		else if (arg == "-dapFuzz") {
+			dapFuzzIterations = 100'000;
+		}
+		else if (arg.starts_with("-dapFuzz=")) {
+			dapFuzzIterations = std::stoul(arg.substr(9));
+		}
+		else if (arg.starts_with("-seed=")) {
+			dapFuzzSeed = std::stoul(arg.substr(6));
+		}
+	}
+
+	// no python involved, only the DAP framing of debugger_session is exercised
+	if (dapFuzzIterations > 0) {
+		std::println("fuzzing the DAP parser with seed {}", dapFuzzSeed);
+		auto result = bf2py::dap_fuzzer{ dapFuzzIterations, dapFuzzSeed }.run();
+		if (!result) {
+			std::println(stderr, "fuzzing failed: {}", result.error());
+			return 1;
+		}
+
+		std::println("{} iterations passed", dapFuzzIterations);
+		return 0;
+	}
+
+	if (dapMessages > 0) {
+		auto result = bf2py::dap_benchmark{ dapMessages }.run();
+		if (!result) {
+			std::println(stderr, "benchmark failed: {}", result.error());
+			return 1;
+		}
+
+		std::println("messages     : {} ({} bytes)", result->messages, result->bytes);
+		std::println("framing      : {:.1f} MB/s", result->framing_mb_per_s);
+		std::println("framing+json : {:.1f} MB/s, {:.1f} ns/message", result->mb_per_s, result->ns_per_message);
+		return 0;
+	}
+
+	// no python involved, only the snapshot is served (until the process is terminated)
+	if (!replaySnapshot.empty()) {
+		auto snapshot = bf2py::snapshot::read(replaySnapshot);
+		if (!snapshot) {
+			std::println(stderr, "{}", snapshot.error());
+			return 1;
+		}
+
+		return bf2py::replay_server{ std::move(*snapshot), static_cast<asio::ip::port_type>(replayPort) }.run();
 	}
 
 	std::signal(SIGINT, signal_handler);
 	std::signal(SIGTERM, signal_handler);
 
 	simulator.dlls(dlls);
+	if (benchmarkIterations > 0) {
+		return simulator.benchmark(benchmarkIterations);
+	}
+
 	return simulator.run();
 }
@@ -0,0 +1,278 @@
+#include "replay_server.h"
+#include <algorithm>
+#include <chrono>
+#include <format>
+#include <print>
+#include <ranges>
+#include <string_view>
+using namespace bf2py;
+using namespace nlohmann;
+
+int replay_server::run()
+{
+	try {
+		asio::io_context ctx;
+		asio::ip::tcp::acceptor acceptor{ ctx, asio::ip::tcp::endpoint{ asio::ip::make_address_v4("127.0.0.1"), _port } };
+		std::println("[replay] serving the snapshot of '{}' ({} frames) on port {}", _snapshot.exception, _snapshot.frames.size(), _port);
+
+		while (acceptor.is_open()) {
+			auto socket = acceptor.accept();
+			_var_refs.clear();
+			_var_ids.clear();
+			serve(socket);
+			std::println("[replay] client disconnected");
+		}
+	}
+	catch (const std::exception& e) {
+		std::println(stderr, "[replay][error] {}", e.what());
+		return 1;
+	}
+
+	return 0;
+}
+
+void replay_server::serve(asio::ip::tcp::socket& socket)
+{
+	auto parser = dap_parser{};
+	while (socket.is_open()) {
+		const auto message = parser.next();
+		if (!message) {
+			std::println(stderr, "[replay][error] {}", message.error());
+			return;
+		}
+
+		if (!*message) {
+			asio::error_code error;
+			const auto space = parser.prepare();
+			parser.commit(socket.read_some(asio::buffer(space.data(), space.size()), error));
+			if (error) {
+				return;
+			}
+
+			continue;
+		}
+
+		const auto request = json::parse(**message, nullptr, false);
+		if (request.is_discarded() || request.value("type", "") != "request") {
+			continue;
+		}
+
+		const auto command = request.value("command", "");
+		std::vector<json> events;
+		const auto body = handle(command, request.value("arguments", json::object()), events);
+		send(socket, {
+			{ "type", "response" },
+			{ "request_seq", request.value("seq", 0) },
+			{ "success", body.has_value() },
+			{ "command", command },
+			{ "message", body ? "" : body.error() },
+			{ "body", body ? *body : json{ { "error", body.error() } } }
+		});
+
+		for (const auto& event : events) {
+			send(socket, event);
+		}
+
+		if (command == "disconnect") {
+			socket.close();
+		}
+	}
+}
+
+void replay_server::send(asio::ip::tcp::socket& socket, const json& data)
+{
+	auto dataBytes = data.dump();
+	asio::error_code error;
+	asio::write(socket, asio::buffer(std::format("Content-Length: {}\r\n\r\n{}", dataBytes.size(), dataBytes)), error);
+}
+
+std::expected<json, std::string> replay_server::handle(const std::string& command, const json& args, std::vector<json>& events)
+{
+	if (command == "initialize") {
+		events.push_back({ { "type", "event" }, { "event", "initialized" } });
+		return json{
+			{ "supportsConfigurationDoneRequest", true },
+			{ "supportsEvaluateForHovers", true }
+		};
+	}
+
+	if (command == "attach" || command == "launch" || command == "setExceptionBreakpoints") {
+		return json::object();
+	}
+
+	if (command == "setBreakpoints" || command == "setFunctionBreakpoints") {
+		auto breakpoints = json::array();
+		for (const auto& bp : args.value("breakpoints", json::array())) {
+			breakpoints.push_back({ { "verified", false }, { "message", "a snapshot cannot break" } });
+		}
+
+		return json{ { "breakpoints", breakpoints } };
+	}
+
+	if (command == "configurationDone") {
+		const auto time = std::chrono::sys_seconds{ std::chrono::seconds{ _snapshot.time } };
+		events.push_back({
+			{ "type", "event" },
+			{ "event", "output" },
+			{ "body", {
+				{ "category", "console" },
+				{ "output", std::format("[replay] snapshot taken {:%Y-%m-%d %H:%M:%S} UTC: {}\n", time, _snapshot.exception) }
+			}}
+		});
+		events.push_back({
+			{ "type", "event" },
+			{ "event", "stopped" },
+			{ "body", {
+				{ "reason", "exception" },
+				{ "threadId", _snapshot.thread },
+				{ "allThreadsStopped", true },
+				{ "text", _snapshot.exception }
+			}}
+		});
+		return json::object();
+	}
+
+	if (command == "threads") {
+		return json{
+			{ "threads", json::array({ { { "id", _snapshot.thread }, { "name", std::format("bf2 ({}, snapshot)", _snapshot.thread) } } }) }
+		};
+	}
+
+	if (command == "stackTrace") {
+		auto stackFrames = json::array();
+		for (std::uint32_t i = 0; i < _snapshot.frames.size(); i++) {
+			const auto& frame = _snapshot.frames[i];
+			auto source = json{ { "name", frame.filename } };
+			if (!frame.filename.starts_with("<") && !frame.filename.contains(".zip")) {
+				source["path"] = frame.filename;
+			}
+
+			stackFrames.push_back({
+				{ "id", i + 1 },
+				{ "name", frame.function },
+				{ "line", frame.line },
+				{ "column", 1 },
+				{ "source", source }
+			});
+		}
+
+		return json{ { "stackFrames", stackFrames }, { "totalFrames", stackFrames.size() } };
+	}
+
+	if (command == "scopes") {
+		const auto frameId = args.value("frameId", std::uint32_t{ 0 });
+		if (frameId == 0 || frameId > _snapshot.frames.size()) {
+			return std::unexpected(std::format("Invalid frameId '{}'", frameId));
+		}
+
+		const auto& frame = _snapshot.frames[frameId - 1];
+		auto scopes = json::array();
+		if (!frame.locals.empty()) {
+			scopes.push_back({ { "name", "Locals" }, { "presentationHint", "locals" }, { "variablesReference", reference(frame.locals) } });
+		}
+
+		scopes.push_back({ { "name", "Globals" }, { "variablesReference", reference(_snapshot.globals[frame.globals]) } });
+		return json{ { "scopes", scopes } };
+	}
+
+	if (command == "variables") {
+		const auto varId = args.value("variablesReference", std::uint32_t{ 0 });
+		if (varId == 0 || varId > _var_refs.size()) {
+			return std::unexpected(std::format("Invalid variablesReference '{}'", varId));
+		}
+
+		auto variables = json::array();
+		for (const auto& child : *_var_refs[varId - 1]) {
+			variables.push_back(variable(child));
+		}
+
+		return json{ { "variables", variables } };
+	}
+
+	if (command == "evaluate") {
+		const auto expression = args.value("expression", "");
+		const auto found = find(args.value("frameId", std::uint32_t{ 1 }), expression);
+		if (!found) {
+			return std::unexpected(std::format("'{}' is not part of the snapshot (only variable names like a.b[0] can be evaluated)", expression));
+		}
+
+		auto result = variable(*found);
+		return json{ { "result", result["value"] }, { "type", result["type"] }, { "variablesReference", result["variablesReference"] } };
+	}
+
+	if (command == "continue" || command == "next" || command == "stepIn" || command == "stepOut" || command == "pause") {
+		return std::unexpected(std::string{ "a snapshot cannot run" });
+	}
+
+	if (command == "disconnect") {
+		return json::object();
+	}
+
+	return std::unexpected(std::format("unsupported request: {}", command));
+}
+
+std::uint32_t replay_server::reference(const std::vector<snapshot::variable>& variables)
+{
+	auto [it, added] = _var_ids.emplace(&variables, static_cast<std::uint32_t>(_var_refs.size() + 1));
+	if (added) {
+		_var_refs.push_back(&variables);
+	}
+
+	return it->second;
+}
+
+json replay_server::variable(const snapshot::variable& variable)
+{
+	return {
+		{ "name", variable.name },
+		{ "type", variable.type },
+		{ "value", variable.value },
+		{ "variablesReference", variable.children.empty() ? 0 : reference(variable.children) }
+	};
+}
+
+const snapshot::variable* replay_server::find(std::uint32_t frameId, const std::string& expression) const
+{
+	if (frameId == 0 || frameId > _snapshot.frames.size()) {
+		return nullptr;
+	}
+
+	// a.b[0] -> a, b, [0] (the names of the captured children)
+	std::vector<std::string> path;
+	for (const auto part : std::views::split(expression, '.')) {
+		auto name = std::string{ part.begin(), part.end() };
+		for (auto pos = name.find('['); pos != std::string::npos; pos = name.find('[')) {
+			if (pos > 0) {
+				path.push_back(name.substr(0, pos));
+			}
+
+			const auto end = name.find(']', pos);
+			path.push_back(name.substr(pos, end == std::string::npos ? end : end - pos + 1));
+			name = end == std::string::npos ? "" : name.substr(end + 1);
+		}
+
+		if (!name.empty()) {
+			path.push_back(std::move(name));
+		}
+	}
+
+	const auto& frame = _snapshot.frames[frameId - 1];
+	const snapshot::variable* current = nullptr;
+	for (const auto& name : path) {
+		auto lookup = [&](const std::vector<snapshot::variable>& variables) -> const snapshot::variable* {
+			auto it = std::ranges::find(variables, name, &snapshot::variable::name);
+			return it != variables.end() ? &*it : nullptr;
+		};
+
+		current = current ? lookup(current->children) : lookup(frame.locals);
+		if (!current && &name == &path.front()) {
+			current = lookup(_snapshot.globals[frame.globals]);
+		}
+
+		if (!current) {
+			return nullptr;
+		}
+	}
+
+	return current;
+}
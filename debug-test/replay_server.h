@@ -0,0 +1,47 @@
+#pragma once
+#ifndef _BF2PY_REPLAY_SERVER_H_
+#define _BF2PY_REPLAY_SERVER_H_
+
+#include "../debug-dll/asio.h"
+#include "../debug-dll/dap_parser.h"
+#include "../debug-dll/snapshot.h"
+#include <cstdint>
+#include <expected>
+#include <nlohmann/json.hpp>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace bf2py {
+	// serves a post-mortem snapshot (written by the debugger with +pyDebugSnapshot) over DAP,
+	// so the stack and variables of the exception can be inspected offline (attach like to bf2)
+	class replay_server {
+		snapshot _snapshot;
+		asio::ip::port_type _port;
+
+		// variablesReference - 1 -> variables, valid for the whole session (the snapshot never changes)
+		std::vector<const std::vector<snapshot::variable>*> _var_refs;
+		std::unordered_map<const std::vector<snapshot::variable>*, std::uint32_t> _var_ids;
+
+	public:
+		explicit replay_server(snapshot snapshot, asio::ip::port_type port = 5678)
+			: _snapshot(std::move(snapshot)), _port(port)
+		{
+		}
+
+		// serves one client after the other, until the process is terminated
+		int run();
+
+	private:
+		void serve(asio::ip::tcp::socket& socket);
+		void send(asio::ip::tcp::socket& socket, const nlohmann::json& data);
+
+		// the response body (or an error message), events to send after the response are appended to events
+		std::expected<nlohmann::json, std::string> handle(const std::string& command, const nlohmann::json& args, std::vector<nlohmann::json>& events);
+		std::uint32_t reference(const std::vector<snapshot::variable>& variables);
+		nlohmann::json variable(const snapshot::variable& variable);
+		const snapshot::variable* find(std::uint32_t frameId, const std::string& expression) const;
+	};
+}
+
+#endif
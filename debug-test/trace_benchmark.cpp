@@ -0,0 +1,224 @@
+#include "trace_benchmark.h"
+#include "python.h"
+#include <algorithm>
+#include <chrono>
+#include <format>
+#include <ranges>
+#include <string_view>
+using namespace bf2py;
+
+namespace {
+	struct workload {
+		const char* name;
+		const char* filename; // the breakpoints of the scenarios are set by filename
+		const char* source; // defines bench(n), the line marked with "# bench:break" gets the conditional breakpoint
+		std::size_t divisor; // bench is called with iterations / divisor, so every workload takes roughly the same time
+	};
+
+	// Note: python 2.3, no conditional expressions or with statements
+	const workload workloads[] = {
+		{ "loop", "bench_loop.py", R"(
+bench_break = 0
+bench_calls = 0
+def bench(n):
+    global bench_calls
+    bench_calls = bench_calls + 1
+    total = 0
+    for i in xrange(n):
+        total = total + i # bench:break
+    return total
+)", 1 },
+		{ "recursion", "bench_recursion.py", R"(
+bench_break = 0
+def descend(depth):
+    if depth == 0: # bench:break
+        return 0
+    return descend(depth - 1) + 1
+
+def bench(n):
+    total = 0
+    for i in xrange(n / 100):
+        total = total + descend(100)
+    return total
+)", 1 },
+		{ "calls", "bench_calls.py", R"(
+bench_break = 0
+def add(a, b):
+    return a + b # bench:break
+
+class Counter:
+    def __init__(self):
+        self.count = 0
+
+    def inc(self):
+        self.count = self.count + 1
+
+def bench(n):
+    counter = Counter()
+    total = 0
+    for i in xrange(n):
+        total = add(total, i)
+        counter.inc()
+    return total
+)", 2 },
+		{ "exceptions", "bench_exceptions.py", R"(
+bench_break = 0
+class BenchError(Exception):
+    pass
+
+def fail(i):
+    raise BenchError(i) # bench:break
+
+def bench(n):
+    caught = 0
+    for i in xrange(n):
+        try:
+            fail(i)
+        except BenchError:
+            caught = caught + 1
+    return caught
+)", 10 }
+	};
+
+	// breakpoints in a file which the workloads never execute (e.g. a breakpoint in another mod script)
+	constexpr std::string_view other_file = "bench_other.py";
+	constexpr std::size_t other_breaks = 20;
+
+	// the best of a few runs, the others are disturbed by the rest of the system
+	constexpr std::size_t repetitions = 3;
+
+	std::size_t counted_events = 0;
+	int count_events(PyObject*, PyFrameObject*, int, PyObject*)
+	{
+		++counted_events;
+		return 0;
+	}
+
+	std::size_t marked_line(std::string_view source)
+	{
+		std::size_t line = 1;
+		for (const auto part : std::views::split(source, '\n')) {
+			if (std::string_view{ part.begin(), part.end() }.contains("# bench:break")) {
+				return line;
+			}
+
+			line++;
+		}
+
+		return 0;
+	}
+}
+
+std::expected<std::vector<trace_benchmark_result>, std::string> trace_benchmark::run()
+{
+	auto tstate = PyThreadState_GET();
+	auto configure = [&](const std::string& option) {
+		return !_configure || _configure(option.c_str()) == 0;
+	};
+
+	// run in __main__, so that +pyDebugWatch=bench_calls watches the benchmark's global
+	auto globals = PyModule_GetDict(PyImport_AddModule((char*)"__main__"));
+
+	std::vector<trace_benchmark_result> results;
+	for (const auto& workload : workloads) {
+		// Note: this is a top level frame, so the debugger waits for a connection unless +pyDebugStopOnEntry=0 is set
+		PyNewRef code = Py_CompileString(const_cast<char*>(workload.source), const_cast<char*>(workload.filename), Py_file_input);
+		PyNewRef res = code ? PyEval_EvalCode(reinterpret_cast<PyCodeObject*>(static_cast<PyObject*>(code)), globals, globals) : nullptr;
+		if (!res) {
+			PyErr_Print();
+			return std::unexpected(std::format("failed to compile the {} workload", workload.name));
+		}
+
+		auto bench = PyDict_GetItemString(globals, "bench");
+		if (!bench) {
+			return std::unexpected(std::format("bench missing in the {} workload", workload.name));
+		}
+
+		const auto n = static_cast<int>(_iterations / workload.divisor);
+		auto measure = [&]() -> std::expected<double, std::string> {
+			auto best = std::chrono::duration<double, std::nano>::max();
+			for (std::size_t i = 0; i < repetitions; i++) {
+				const auto start = std::chrono::steady_clock::now();
+				PyNewRef benchRes = PyObject_CallFunction(bench, (char*)"i", n);
+				const auto end = std::chrono::steady_clock::now();
+				if (!benchRes) {
+					PyErr_Print();
+					return std::unexpected(std::format("the {} workload raised an exception", workload.name));
+				}
+
+				best = std::min<std::chrono::duration<double, std::nano>>(best, end - start);
+			}
+
+			return best.count();
+		};
+
+		// the trace function of the debugger, as installed for the current scenario
+		auto measure_traced = [&]() -> std::expected<double, std::string> {
+			if (!tstate->c_tracefunc) {
+				return std::unexpected("no trace function installed - was the debug dll injected with +pyDebugForceTrace=1?");
+			}
+
+			return measure();
+		};
+
+		// keep the debugger's trace object alive while its trace function is replaced
+		auto measure_with = [&](Py_tracefunc func) {
+			auto traceFunc = tstate->c_tracefunc;
+			PyObject* traceObj = tstate->c_traceobj;
+			Py_XINCREF(traceObj);
+			PyEval_SetTrace(func, nullptr);
+			auto result = measure();
+			PyEval_SetTrace(traceFunc, traceObj);
+			Py_XDECREF(traceObj);
+			return result;
+		};
+
+		counted_events = 0;
+		auto counted = measure_with(count_events);
+		auto untraced = measure_with(nullptr);
+		if (!counted || !untraced) {
+			return std::unexpected(!counted ? counted.error() : untraced.error());
+		}
+
+		if (counted_events == 0) {
+			return std::unexpected(std::format("the {} workload generated no trace events", workload.name));
+		}
+
+		const auto events = static_cast<double>(counted_events / repetitions);
+		auto& result = results.emplace_back(trace_benchmark_result{
+			.workload = workload.name,
+			.events = counted_events / repetitions,
+			.untraced_ns = *untraced / events
+		});
+
+		std::vector<std::pair<std::string, std::vector<std::string>>> scenarios;
+		scenarios.push_back({ "no_breakpoints", {} });
+		if (_configure) {
+			std::vector<std::string> otherBreaks;
+			for (std::size_t line = 1; line <= other_breaks; line++) {
+				otherBreaks.push_back(std::format("break={}|{}", other_file, line));
+			}
+
+			scenarios.push_back({ "breakpoints_elsewhere", std::move(otherBreaks) });
+			scenarios.push_back({ "conditional_breakpoint", { std::format("break={}|{}|bench_break", workload.filename, marked_line(workload.source)) } });
+			scenarios.push_back({ "exception_filter", { "exceptions=unhandled" } });
+		}
+
+		for (const auto& [name, options] : scenarios) {
+			if (!configure("clear") || !std::ranges::all_of(options, configure)) {
+				return std::unexpected(std::format("the debugger rejected the options of the {} scenario", name));
+			}
+
+			auto traced = measure_traced();
+			if (!traced) {
+				return std::unexpected(traced.error());
+			}
+
+			result.traced.push_back({ .name = name, .ns = *traced / events });
+		}
+
+		configure("clear");
+	}
+
+	return results;
+}
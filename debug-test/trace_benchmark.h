@@ -0,0 +1,43 @@
+#pragma once
+#ifndef _BF2PY_TRACE_BENCHMARK_H_
+#define _BF2PY_TRACE_BENCHMARK_H_
+
+#include <cstddef>
+#include <expected>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace bf2py {
+	struct trace_benchmark_result {
+		struct scenario {
+			std::string name;
+			double ns = 0; // per trace event
+		};
+
+		std::string workload;
+		std::size_t events = 0;
+		double untraced_ns = 0;
+		std::vector<scenario> traced;
+	};
+
+	// measures the cost of the installed trace function (the injected debugger) per trace event
+	// by running synthetic python workloads (tight loops, recursion, small calls, exceptions)
+	// untraced and traced in different scenarios (no breakpoints, breakpoints elsewhere, conditions, exception filters)
+	class trace_benchmark {
+	public:
+		// applies one option of the injected debugger (bf2pyBenchmarkConfigure), returns 0 on success
+		using configure_t = std::function<int(const char*)>;
+
+	private:
+		std::size_t _iterations;
+		configure_t _configure;
+
+	public:
+		trace_benchmark(std::size_t iterations, configure_t configure) : _iterations(iterations), _configure(std::move(configure)) {}
+
+		std::expected<std::vector<trace_benchmark_result>, std::string> run();
+	};
+}
+
+#endif